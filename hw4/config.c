@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "config.h"
+#include "error.h"
+
+typedef enum {Int, Long, Ms, Real, Text} Type;
+
+// One parameter: its name, type, where it lives, its default, and a blurb
+typedef struct {
+  const char *key;
+  Type type;
+  size_t off;
+  const char *def;
+  const char *help;
+} Param;
+
+#define P(key, type, def, help) {#key, type, offsetof(Config, key), def, help}
+
+static const Param params[] = {
+  P(producers,    Int,  "15",      "producer threads"),
+  P(consumers,    Int,  "15",      "consumer threads"),
+  P(mtqmax,       Int,  "4",       "queue capacity, 0 = unbounded"),
+  P(engine,       Text, "mutex",   "queue implementation"),
+  P(policy,       Text, "block",   "full queue: block, reject, drop-newest, drop-oldest, timeout"),
+  P(put_timeout,  Ms,   "100ms",   "how long a put waits, under the timeout policy"),
+  P(adapt_min,    Int,  "1",       "adaptive queue's least capacity"),
+  P(adapt_max,    Int,  "0",       "adaptive queue's greatest capacity, 0 = fixed at mtqmax"),
+  P(adapt_target, Ms,   "5ms",     "adaptive queue's target standing sojourn"),
+  P(adapt_interval, Ms, "100ms",   "adaptive queue's adjustment interval"),
+  P(lawnsize,     Int,  "40",      "moles per lawn side"),
+  P(molesize,     Int,  "15",      "pixels per mole side"),
+  P(backend,      Text, "auto",    "lawn display: auto, text, fltk, raster, or shm"),
+  P(frames,       Text, "",        "raster frames to write: frame%05d.ppm, or raw RGBA video"),
+  P(shm,          Text, "/wam-lawn", "shm backend's shared-memory ring, for view/view"),
+  P(frame_ms,     Ms,   "16ms",    "raster frame, or shm publish, period"),
+  P(vimlo,        Ms,   "1s",      "shortest mole phase"),
+  P(vimhi,        Ms,   "5s",      "longest mole phase"),
+  P(duration,     Ms,   "0",       "how long to produce, 0 = until moles are made"),
+  P(moles,        Int,  "0",       "moles to make, 0 = one per producer (a batch each, with batch)"),
+  P(batch,        Int,  "0",       "moles per queued batch, 0 = queue moles one by one"),
+  P(stop_policy,  Text, "finish",  "on SIGINT or SIGTERM: finish, or discard, the moles in flight"),
+  P(stop_budget,  Ms,   "5s",      "how long exit may take once signalled, 0 = no limit"),
+  P(snapshot,     Text, "",        "queued-mole snapshot to write on SIGUSR1, at a stop, and at the end"),
+  P(snapshot_ms,  Ms,   "0",       "snapshot period, 0 = none"),
+  P(restore,      Text, "",        "queued-mole snapshot to restore at start"),
+  P(seed,         Long, "0",       "random seed, 0 = time of day (1 in a simulation)"),
+  P(sim,          Int,  "0",       "1 = run in virtual time, deterministically, on the text lawn"),
+  P(record,       Text, "",        "binary event log to write"),
+  P(record_max,   Long, "1048576", "event log capacity, in events"),
+  P(replay,       Text, "",        "binary event log to replay"),
+  P(replay_speed, Real, "1",       "replay speedup"),
+  P(rate,         Real, "0",       "open-loop arrivals per second, 0 = closed loop"),
+  P(arrival,      Text, "constant","open-loop arrivals: constant, poisson, or bursty"),
+  P(burst_period, Ms,   "1s",      "bursty on/off cycle length"),
+  P(burst_duty,   Real, "0.2",     "bursty fraction of each cycle that is on"),
+  P(report,       Ms,   "1s",      "open-loop or pipeline progress interval, 0 = none"),
+  P(pipeline,     Text, "",        "threads per pipeline stage, e.g. 1,4,8,8,1"),
+  P(pipe_batch,   Text, "1,1,1,1,1", "batch size per pipeline stage"),
+  P(metrics,      Text, "",        "Unix socket to serve Prometheus metrics on"),
+  P(trace,        Text, "wam-trace.json", "Chrome trace file, in a TRACE=1 build"),
+  P(sweep,        Text, "",        "scalability sweep CSV to write, - = stdout"),
+  P(sweep_time,   Ms,   "500ms",   "length of each sweep run"),
+  P(sweep_reps,   Int,  "3",       "runs per sweep point"),
+  P(role,         Text, "",        "run as one process: producer or consumer"),
+  P(shared,       Text, "/wam-mtq", "shared-memory mtq joining producer and consumer processes"),
+};
+
+#define NPARAMS (sizeof(params) / sizeof(params[0]))
+
+static const Param *find(const char *key, size_t len) {
+  for (size_t i = 0; i < NPARAMS; i++) {
+    const char *k = params[i].key;
+    size_t j = 0;
+    // flags may spell _ as -
+    while (j < len && k[j] && (k[j] == key[j] || (k[j] == '_' && key[j] == '-')))
+      j++;
+    if (j == len && !k[j])
+      return &params[i];
+  }
+  return 0;
+}
+
+/* Parses a time into ms: "250", "250ms", "1.5s", "2m" */
+static int ms(const Param *p, const char *v) {
+  char *end;
+  double d = strtod(v, &end);
+  double scale = 1;
+  if (!strcmp(end, "s"))
+    scale = 1000;
+  else if (!strcmp(end, "m"))
+    scale = 60000;
+  else if (*end && strcmp(end, "ms"))
+    ERROR("%s: bad time: %s", p->key, v);
+  return (int)(d * scale + 0.5);
+}
+
+static long integer(const Param *p, const char *v) {
+  char *end;
+  errno = 0;
+  long l = strtol(v, &end, 0);
+  if (errno || end == v || *end)
+    ERROR("%s: bad number: %s", p->key, v);
+  return l;
+}
+
+static void set(Config *c, const Param *p, const char *v) {
+  void *at = (char *)c + p->off;
+  switch (p->type) {
+  case Int:  *(int *)at = (int)integer(p, v); break;
+  case Long: *(long *)at = integer(p, v); break;
+  case Ms:   *(int *)at = ms(p, v); break;
+  case Real: *(double *)at = atof(v); break;
+  case Text:
+    free(*(char **)at);
+    *(char **)at = strdup(v);
+    break;
+  }
+}
+
+/* Reads "key = value" lines; # starts a comment */
+static void file(Config *c, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) ERROR("%s: %s", path, strerror(errno));
+  char line[512];
+  for (int n = 1; fgets(line, sizeof(line), f); n++) {
+    char *s = line, *hash = strchr(s, '#');
+    if (hash) *hash = 0;
+    while (isspace((unsigned char)*s)) s++;
+    if (!*s) continue;
+    char *eq = strchr(s, '=');
+    if (!eq) ERROR("%s:%d: expected key = value", path, n);
+    char *k = eq;
+    while (k > s && isspace((unsigned char)k[-1])) k--;
+    char *v = eq + 1;
+    while (isspace((unsigned char)*v)) v++;
+    char *e = v + strlen(v);
+    while (e > v && isspace((unsigned char)e[-1])) *--e = 0;
+    const Param *p = find(s, k - s);
+    if (!p) ERROR("%s:%d: unknown key", path, n);
+    set(c, p, v);
+  }
+  fclose(f);
+}
+
+static void env(Config *c) {
+  for (size_t i = 0; i < NPARAMS; i++) {
+    char name[64] = "WAM_";
+    for (int j = 0; params[i].key[j]; j++)
+      name[4 + j] = toupper((unsigned char)params[i].key[j]);
+    char *v = getenv(name);
+    if (v)
+      set(c, &params[i], v);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [--config=file] [--key=value]...\n", prog);
+  for (size_t i = 0; i < NPARAMS; i++)
+    fprintf(stderr, "  --%-14s %s (default %s)\n", params[i].key, params[i].help,
+            *params[i].def ? params[i].def : "none");
+  exit(1);
+}
+
+/**
+ * Builds the configuration from defaults, a config file, the environment,
+ * and the command line, in that order of precedence.
+ *
+ * @return a malloc()ed Config; free with config_free().
+ */
+extern Config *config_load(int argc, char **argv) {
+  Config *c = calloc(1, sizeof(*c));
+  if (!c) ERROR("calloc() failed");
+  for (size_t i = 0; i < NPARAMS; i++)
+    set(c, &params[i], params[i].def);
+
+  // the file comes first, so the environment and flags override it
+  const char *path = getenv("WAM_CONFIG");
+  for (int i = 1; i < argc; i++)
+    if (!strncmp(argv[i], "--config=", 9))
+      path = argv[i] + 9;
+    else if (!strcmp(argv[i], "--config") && i + 1 < argc)
+      path = argv[++i];
+  if (path)
+    file(c, path);
+  env(c);
+
+  for (int i = 1; i < argc; i++) {
+    char *a = argv[i];
+    if (strncmp(a, "--", 2))
+      usage(argv[0]);
+    a += 2;
+    char *eq = strchr(a, '=');
+    size_t len = eq ? (size_t)(eq - a) : strlen(a);
+    if (len == 6 && !strncmp(a, "config", 6)) {
+      if (!eq) i++;
+      continue;
+    }
+    const Param *p = find(a, len);
+    if (!p)
+      usage(argv[0]);
+    if (eq)
+      set(c, p, eq + 1);
+    else if (i + 1 < argc)
+      set(c, p, argv[++i]);
+    else
+      usage(argv[0]);
+  }
+
+  if (c->producers < 1 || c->consumers < 1)
+    ERROR("need at least one producer and one consumer");
+  if (c->mtqmax < 0 || c->moles < 0 || c->duration < 0 || c->batch < 0)
+    ERROR("mtqmax, moles, batch and duration must not be negative");
+  if (strcmp(c->stop_policy, "finish") && strcmp(c->stop_policy, "discard"))
+    ERROR("unknown stop policy: %s", c->stop_policy);
+  if (c->stop_budget < 0)
+    ERROR("stop_budget must not be negative");
+  if (c->vimlo < 0 || c->vimhi < c->vimlo)
+    ERROR("need 0 <= vimlo <= vimhi");
+  if (c->lawnsize < 1 || c->molesize < 1)
+    ERROR("lawnsize and molesize must be positive");
+  if (c->rate < 0 || c->burst_duty <= 0 || c->burst_duty > 1 || c->burst_period <= 0)
+    ERROR("need rate >= 0, 0 < burst_duty <= 1, and burst_period > 0");
+  return c;
+}
+
+/* Writes the effective configuration to stderr, in config-file syntax */
+extern void config_print(Config *c) {
+  for (size_t i = 0; i < NPARAMS; i++) {
+    void *at = (char *)c + params[i].off;
+    fprintf(stderr, "%s = ", params[i].key);
+    switch (params[i].type) {
+    case Int:  fprintf(stderr, "%d\n", *(int *)at); break;
+    case Long: fprintf(stderr, "%ld\n", *(long *)at); break;
+    case Ms:   fprintf(stderr, "%dms\n", *(int *)at); break;
+    case Real: fprintf(stderr, "%g\n", *(double *)at); break;
+    case Text: fprintf(stderr, "%s\n", *(char **)at); break;
+    }
+  }
+}
+
+extern void config_free(Config *c) {
+  for (size_t i = 0; i < NPARAMS; i++)
+    if (params[i].type == Text)
+      free(*(char **)((char *)c + params[i].off));
+  free(c);
+}
@@ -0,0 +1,61 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Runtime parameters. Each is set, last one winning, from: its default,
+// a "key = value" file named by --config or WAM_CONFIG, an environment
+// variable WAM_<KEY>, and a command-line flag --key=value (or --key value).
+// Times accept a unit suffix (250ms, 1.5s); a bare number is milliseconds.
+
+typedef struct {
+  int producers;     // producer threads
+  int consumers;     // consumer threads
+  int mtqmax;        // queue capacity, 0 = unbounded
+  char *engine;      // queue implementation
+  char *policy;      // what a put does when the queue is full
+  int put_timeout;   // ms a put waits for room, under the timeout policy
+  int adapt_min;     // adaptive capacity bounds; adapt_max 0 = fixed at mtqmax
+  int adapt_max;
+  int adapt_target;  // ms of standing sojourn the adaptive capacity aims under
+  int adapt_interval; // ms between adjustments
+  int lawnsize;      // moles per lawn side
+  int molesize;      // pixels per mole side
+  char *backend;     // lawn display: auto, text, fltk, raster, or shm
+  char *frames;      // raster frames to write: PPMs if it has %d, else raw RGBA
+  char *shm;         // shm backend's ring, for a viewer
+  int frame_ms;      // raster frame, or shm publish, period
+  int vimlo, vimhi;  // mole phase lengths, ms
+  int duration;      // ms to keep producing, 0 = until moles are made
+  int moles;         // moles to make, 0 = one per producer (or unlimited with duration)
+  int batch;         // moles per queued item (MoleBatch), 0 = one Mole each
+  char *stop_policy; // on SIGINT or SIGTERM: finish, or discard, the moles in flight
+  int stop_budget;   // ms the process may take to exit, once signalled; 0 = no limit
+  char *snapshot;    // where to snapshot the queued moles: on SIGUSR1, each snapshot_ms, and at a stop
+  int snapshot_ms;   // 0 = not periodically
+  char *restore;     // snapshot to restore the queue from, at start
+  long seed;         // random seed, 0 = time of day
+  int sim;           // run in virtual time (vclock.h)
+  char *record;      // binary event log to write
+  long record_max;   // its capacity, in events
+  char *replay;      // binary event log to replay instead of producing
+  double replay_speed;
+  double rate;       // open-loop arrivals per second, 0 = closed loop
+  char *arrival;     // constant, poisson, or bursty
+  int burst_period;  // ms per bursty on/off cycle
+  double burst_duty; // fraction of each cycle that is on
+  int report;        // ms between open-loop or pipeline progress lines, 0 = none
+  char *pipeline;    // threads per stage: "generate,create,whack,expire,free"
+  char *pipe_batch;  // batch size per stage, same order
+  char *metrics;     // Unix socket to serve metrics on
+  char *trace;       // Chrome trace file, in a -DTRACE build
+  char *sweep;       // CSV to write a scalability sweep to, "-" = stdout
+  int sweep_time;    // ms per sweep run
+  int sweep_reps;    // runs per sweep point
+  char *role;        // producer or consumer, as one process of several
+  char *shared;      // shared mtq joining the processes
+} Config;
+
+extern Config *config_load(int argc, char **argv);
+extern void    config_print(Config *c);
+extern void    config_free(Config *c);
+
+#endif
@@ -4,6 +4,8 @@
 
 #include "deq.h"
 #include "error.h"
+#include "prof.h"
+#include "mem.h"
 
 /* Enum for indices and size of array of node pointers */
 typedef enum {Head, Tail, Ends} End;
@@ -39,6 +41,7 @@ static Rep rep(Deq q) {
  * @return void
  */
 static void put(Rep r, End e, Data d) {
+  PROF_SCOPE("deq put");
    // Check if the deque representation is NULL
   if (r == NULL) {
     ERROR("Attempting to add a node to a non-existent deq");
@@ -53,6 +56,7 @@ static void put(Rep r, End e, Data d) {
     ERROR("Failed memory allocation for new node");
     return;
   }
+  mem_add(MemDeq, sizeof(*newNode));
 
   //initialize node data and head/tail pointers
   newNode->data = d;
@@ -91,6 +95,7 @@ static void put(Rep r, End e, Data d) {
  * @return Data at the i-th index; 0 if an error occurs.
  */
 static Data ith(Rep r, End e, int i) {
+  PROF_SCOPE("deq ith");
   //validate index
   if (i < 0 || i >= r->len) {
     ERROR("Invalid index");
@@ -132,6 +137,7 @@ static Data ith(Rep r, End e, int i) {
  * @return   Data (d) from the removed node; error if the deque is empty.
  */
 static Data get(Rep r, End e) {
+  PROF_SCOPE("deq get");
   //check if the deque is empty
   if (r->len == 0) {
     ERROR("Deq is empty - cannot get from empty list");
@@ -164,6 +170,7 @@ static Data get(Rep r, End e) {
 
   //free node memory
   free(currentNode);
+  mem_add(MemDeq, -(long)sizeof(*currentNode));
   //decrement deq length
   r->len--;
   //return data
@@ -182,6 +189,7 @@ static Data get(Rep r, End e) {
  * @return: Returns the data that was removed or the original data if not found.
  */
 static Data rem(Rep r, End e, Data d) {
+  PROF_SCOPE("deq rem");
   
   //check if list is empty
   if (!r || r->len == 0) {
@@ -223,6 +231,7 @@ static Data rem(Rep r, End e, Data d) {
       Data removedData = currentNode->data;
       //free current node memory
       free(currentNode);
+      mem_add(MemDeq, -(long)sizeof(*currentNode));
       //decrement deq after removal of current node
       r->len--;
       //return data removed
@@ -241,6 +250,7 @@ static Data rem(Rep r, End e, Data d) {
 extern Deq deq_new() {
   Rep r = (Rep)malloc(sizeof(*r));
   if (!r) ERROR("malloc() failed");
+  mem_add(MemDeq, sizeof(*r));
   r->ht[Head] = 0;
   r->ht[Tail] = 0;
   r->len = 0;
@@ -280,6 +290,12 @@ extern void deq_map(Deq q, DeqMapF f) {
     f(n->data);
 }
 
+/* Function to apply a function, with an argument, on each data element, from head to tail */
+extern void deq_each(Deq q, DeqEachF f, void *arg) {
+  for (Node n = rep(q)->ht[Head]; n; n = n->np[Tail])
+    f(n->data, arg);
+}
+
 /* Function to delete the doubly-ended queue */
 extern void deq_del(Deq q, DeqMapF f) {
   if (f) deq_map(q, f);
@@ -287,8 +303,10 @@ extern void deq_del(Deq q, DeqMapF f) {
   while (curr) {
     Node next = curr->np[Tail];
     free(curr);
+    mem_add(MemDeq, -(long)sizeof(*curr));
     curr = next;
   }
+  mem_add(MemDeq, -(long)sizeof(*rep(q)));
   free(q);
 }
 
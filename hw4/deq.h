@@ -25,8 +25,10 @@ extern Data deq_tail_rem(Deq q, Data d);
 typedef char *Str;
 typedef void (*DeqMapF)(Data d);
 typedef Str  (*DeqStrF)(Data d);
+typedef void (*DeqEachF)(Data d, void *arg);
 
 extern void deq_map(Deq q, DeqMapF f); // foreach
+extern void deq_each(Deq q, DeqEachF f, void *arg); // foreach, with an argument
 extern void deq_del(Deq q, DeqMapF f); // free
 extern Str  deq_str(Deq q, DeqStrF f); // toString
 
@@ -4,16 +4,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define WARNLOC(file,line,kind,args...) do {  \
-  fprintf(stderr,"%s:%d: ",file,line);        \
-  fprintf(stderr,"%s: ",kind);                \
-  fprintf(stderr,args);                       \
-  fprintf(stderr,"\n");                       \
-  fflush(stderr);                             \
-} while (0)
+#include "log.h"
+
+#if LOG_LEVEL <= LOG_WARN
+#define WARNLOC(file,line,kind,args...) log_loc(2,file,line,kind,args)
+#else
+#define WARNLOC(file,line,kind,args...) do {} while (0)
+#endif
 
+// Errors are never filtered or queued: everything logged so far, then
+// the error, is written before the process exits.
 #define ERRORLOC(file,line,kind,args...) do { \
-  WARNLOC(file,line,kind,args);               \
+  log_now(2,file,line,kind,args);             \
   exit(1);                                    \
 } while (0)
 
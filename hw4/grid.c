@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "grid.h"
+#include "error.h"
+#include "mem.h"
+
+// Representation of a Grid: n*n occupant pointers, row-major
+typedef struct {
+  int n;          // cells per side
+  int cellsize;   // pixels per cell side
+  int live;       // occupied cells
+  void **cells;   // occupant of each cell, 0 if empty
+} *Rep;
+
+static Rep rep(Grid g) {
+  if (!g) ERROR("zero pointer");
+  return (Rep)g;
+}
+
+/**
+ * Creates an empty grid of n-by-n cells.
+ *
+ * @param n        cells per side.
+ * @param cellsize pixels per cell side.
+ *
+ * @return the new grid.
+ */
+extern Grid grid_new(int n, int cellsize) {
+  if (n <= 0 || cellsize <= 0)
+    ERROR("bad grid dimensions: %d cells of %d pixels", n, cellsize);
+  Rep r = (Rep)malloc(sizeof(*r));
+  if (!r) ERROR("malloc() failed");
+  r->cells = (void **)calloc((size_t)n * n, sizeof(*r->cells));
+  if (!r->cells) ERROR("calloc() failed");
+  mem_add(MemLawn, sizeof(*r) + (long)n * n * sizeof(*r->cells));
+  r->n = n;
+  r->cellsize = cellsize;
+  r->live = 0;
+  return r;
+}
+
+/* Frees a grid; occupants are not touched */
+extern void grid_free(Grid g) {
+  Rep r = rep(g);
+  mem_add(MemLawn, -(long)(sizeof(*r) + (long)r->n * r->n * sizeof(*r->cells)));
+  free(r->cells);
+  free(r);
+}
+
+/* Returns the number of cells in the grid */
+extern int grid_cells(Grid g) { return rep(g)->n * rep(g)->n; }
+
+/* Returns the number of occupied cells, a snapshot under concurrent updates */
+extern int grid_live(Grid g) { return __atomic_load_n(&rep(g)->live, __ATOMIC_RELAXED); }
+
+/**
+ * Maps a pixel coordinate to the index of the cell containing it.
+ *
+ * @return the cell index; -1 if (x,y) is off the grid.
+ */
+extern int grid_cell(Grid g, int x, int y) {
+  Rep r = rep(g);
+  int cx = x / r->cellsize;
+  int cy = y / r->cellsize;
+  if (x < 0 || y < 0 || cx >= r->n || cy >= r->n)
+    return -1;
+  return cy * r->n + cx;
+}
+
+/* Maps a cell index to the pixel coordinate of its top-left corner */
+extern void grid_xy(Grid g, int c, int *x, int *y) {
+  Rep r = rep(g);
+  *x = (c % r->n) * r->cellsize;
+  *y = (c / r->n) * r->cellsize;
+}
+
+/**
+ * Claims an empty cell for an occupant.
+ *
+ * @param c cell index.
+ * @param d the new occupant; must not be 0.
+ *
+ * @return 1 if the cell was empty and now holds d; 0 otherwise.
+ */
+extern int grid_claim(Grid g, int c, void *d) {
+  Rep r = rep(g);
+  void *empty = 0;
+  if (c < 0 || c >= r->n * r->n)
+    return 0;
+  if (!__atomic_compare_exchange_n(&r->cells[c], &empty, d, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return 0;
+  __atomic_add_fetch(&r->live, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/**
+ * Empties a cell, but only if d is its occupant.
+ *
+ * @return 1 if d was released; 0 if the cell held something else.
+ */
+extern int grid_release(Grid g, int c, void *d) {
+  Rep r = rep(g);
+  if (c < 0 || c >= r->n * r->n)
+    return 0;
+  if (!__atomic_compare_exchange_n(&r->cells[c], &d, 0, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return 0;
+  __atomic_sub_fetch(&r->live, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Returns the occupant of a cell, or 0 if it is empty or off-grid */
+extern void *grid_at(Grid g, int c) {
+  Rep r = rep(g);
+  if (c < 0 || c >= r->n * r->n)
+    return 0;
+  return __atomic_load_n(&r->cells[c], __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,23 @@
+#ifndef GRID_H
+#define GRID_H
+
+// A uniform n-by-n grid of square cells, each holding at most one
+// occupant. Every operation is O(1) and lock-free: cells are updated
+// with compare-and-swap, so concurrent claims of one cell have a single
+// winner.
+
+typedef void *Grid;
+
+extern Grid  grid_new(int n, int cellsize);
+extern void  grid_free(Grid g);
+
+extern int   grid_cells(Grid g);                   // n*n
+extern int   grid_live(Grid g);                    // occupied cells
+extern int   grid_cell(Grid g, int x, int y);      // pixel to cell, -1 if off-grid
+extern void  grid_xy(Grid g, int c, int *x, int *y); // cell to pixel origin
+
+extern int   grid_claim(Grid g, int c, void *d);   // 1 iff c was empty
+extern int   grid_release(Grid g, int c, void *d); // 1 iff d occupied c
+extern void *grid_at(Grid g, int c);               // occupant, or 0
+
+#endif
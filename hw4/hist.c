@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hist.h"
+#include "error.h"
+
+#define SUB     16              // buckets per power of two
+#define SUBBITS 4
+#define BUCKETS (64 * SUB)
+
+// Representation of a Hist
+typedef struct {
+  uint64_t n[BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+} *Rep;
+
+static Rep rep(Hist h) {
+  if (!h) ERROR("zero pointer");
+  return (Rep)h;
+}
+
+/* Maps a value to its bucket: small values exactly, then 16 per octave */
+static int bucket(uint64_t v) {
+  if (v < SUB)
+    return v;
+  int msb = 63 - __builtin_clzll(v);
+  int sub = (v >> (msb - SUBBITS)) & (SUB - 1);
+  return (msb - SUBBITS + 1) * SUB + sub;
+}
+
+/* The largest value that maps to bucket b */
+static uint64_t top(int b) {
+  if (b < SUB)
+    return b;
+  int msb = b / SUB + SUBBITS - 1;
+  uint64_t lo = ((uint64_t)1 << msb) | ((uint64_t)(b % SUB) << (msb - SUBBITS));
+  return lo + ((uint64_t)1 << (msb - SUBBITS)) - 1;
+}
+
+extern Hist hist_new() {
+  Rep r = (Rep)calloc(1, sizeof(*r));
+  if (!r) ERROR("calloc() failed");
+  return r;
+}
+
+extern void hist_free(Hist h) { free(rep(h)); }
+
+/* Records one value */
+extern void hist_add(Hist h, uint64_t v) {
+  Rep r = rep(h);
+  __atomic_add_fetch(&r->n[bucket(v)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&r->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&r->sum, v, __ATOMIC_RELAXED);
+  uint64_t m = __atomic_load_n(&r->max, __ATOMIC_RELAXED);
+  while (v > m && !__atomic_compare_exchange_n(&r->max, &m, v, 1,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ * Moves every value from one histogram into another. Values added to from
+ * during the move land in one or the other, never both.
+ */
+extern void hist_move(Hist to, Hist from) {
+  Rep t = rep(to), f = rep(from);
+  for (int b = 0; b < BUCKETS; b++)
+    if (__atomic_load_n(&f->n[b], __ATOMIC_RELAXED))
+      __atomic_add_fetch(&t->n[b], __atomic_exchange_n(&f->n[b], 0, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+  __atomic_add_fetch(&t->count, __atomic_exchange_n(&f->count, 0, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&t->sum, __atomic_exchange_n(&f->sum, 0, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+  uint64_t m = __atomic_exchange_n(&f->max, 0, __ATOMIC_RELAXED);
+  if (m > t->max)
+    t->max = m;
+}
+
+extern uint64_t hist_count(Hist h) { return __atomic_load_n(&rep(h)->count, __ATOMIC_RELAXED); }
+
+extern uint64_t hist_max(Hist h) { return __atomic_load_n(&rep(h)->max, __ATOMIC_RELAXED); }
+
+extern double hist_mean(Hist h) {
+  Rep r = rep(h);
+  return r->count ? (double)r->sum / r->count : 0;
+}
+
+/**
+ * Returns the value at a percentile: the top of the bucket holding the
+ * pct-th percent value, capped at the largest value seen.
+ */
+extern uint64_t hist_pct(Hist h, double pct) {
+  Rep r = rep(h);
+  uint64_t total = 0;
+  for (int b = 0; b < BUCKETS; b++)
+    total += r->n[b];
+  if (!total)
+    return 0;
+  uint64_t want = (uint64_t)(pct / 100 * total + 0.5), seen = 0;
+  if (want < 1)
+    want = 1;
+  for (int b = 0; b < BUCKETS; b++) {
+    seen += r->n[b];
+    if (seen >= want)
+      return top(b) < r->max ? top(b) : r->max;
+  }
+  return r->max;
+}
@@ -0,0 +1,24 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+
+// A log-linear histogram of non-negative values, such as latencies in ns.
+// Each power of two is split into 16 buckets, so a percentile is within
+// about 6% of the true value. Adding is one atomic increment, so any
+// number of threads may add to one histogram at once.
+
+typedef void *Hist;
+
+extern LINKAGE Hist     hist_new();
+extern LINKAGE void     hist_free(Hist h);
+extern LINKAGE void     hist_add(Hist h, uint64_t v);
+extern LINKAGE void     hist_move(Hist to, Hist from); // from is emptied
+extern LINKAGE uint64_t hist_count(Hist h);
+extern LINKAGE uint64_t hist_pct(Hist h, double pct);  // 0 < pct <= 100
+extern LINKAGE uint64_t hist_max(Hist h);
+extern LINKAGE double   hist_mean(Hist h);
+
+#endif
@@ -12,6 +12,23 @@
 #include "lawnimp.h"
 #undef LAWNIMP
 #include "error.h"
+#include "grid.h"
+#include "raster.h"
+#include "publish.h"
+#include "vclock.h"
+#include "mem.h"
+
+// Open lawns, by handle, so a mole can name its lawn in a byte
+static struct {
+  pthread_mutex_t lock;
+  LawnRep rep[LAWNS];
+} lawns = {PTHREAD_MUTEX_INITIALIZER};
+
+/* Returns the open lawn with a handle */
+extern LawnRep lawn_rep(int handle)
+{
+  return lawns.rep[handle];
+}
 
 /**
  * Threaded entry point that manages execution of the graphics representation for the lawn. 
@@ -40,7 +57,25 @@ static void configure_signal_mask(sigset_t *new_signal_mask, sigset_t *prev_sign
 }
 
 /**
- * Creates and initializes a new Lawn object and sets up associated thread
+ * Maps a backend name (auto, text, fltk, raster, shm) to its LawnBackend.
+ *
+ * @param name the backend name.
+ *
+ * @return the backend.
+ */
+extern LawnBackend lawn_backend(const char *name)
+{
+  static const char *names[] = {"auto", "text", "fltk", "raster", "shm"};
+  for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+    if (!strcmp(name, names[i]))
+      return (LawnBackend)i;
+  ERROR("unknown lawn backend: %s", name);
+  return LawnAuto;
+}
+
+/**
+ * Creates and initializes a new Lawn object, shown as FLTK if DISPLAY is
+ * set and as text otherwise, and sets up associated thread
  *
  * @param lawnsize size of the lawn.
  * @param molesize size of the moles.
@@ -48,27 +83,78 @@ static void configure_signal_mask(sigset_t *new_signal_mask, sigset_t *prev_sign
  * @return Returns a newly created Lawn object.
  */
 extern Lawn lawn_new(int lawnsize, int molesize)
+{
+  return lawn_open(lawnsize, molesize, LawnAuto, 0, 0);
+}
+
+/**
+ * Creates and initializes a new Lawn object with a given backend, and
+ * sets up associated thread
+ *
+ * @param lawnsize size of the lawn.
+ * @param molesize size of the moles.
+ * @param backend how the lawn shows its moles.
+ * @param out LawnRaster: where to write frames (see raster_run), or 0;
+ *            LawnShm: the shared-memory ring's name.
+ * @param period_ms LawnRaster, LawnShm: how often to draw or publish.
+ *
+ * @return Returns a newly created Lawn object.
+ */
+extern Lawn lawn_open(int lawnsize, int molesize, LawnBackend backend,
+                      const char *out, int period_ms)
 {
   // assign default values for lawnsize and molesize
   if (!lawnsize)
     lawnsize = 40;
   if (!molesize)
     molesize = 15;
+  if (backend == LawnAuto)
+  {
+    char *v = getenv("DISPLAY");
+    backend = v && *v ? LawnFltk : LawnText;
+  }
 
   // initialize Xlib library for threaded use, multiple threads will access Xlib.
-  XInitThreads();
+  if (backend == LawnFltk)
+    XInitThreads();
+
+  // a mole's position is 16 bits
+  if (lawnsize * molesize > 65535)
+    ERROR("lawn too large: %d moles of %d pixels a side", lawnsize, molesize);
 
   // allocate memory for new LawnRep and ensure success
   LawnRep lawn = (LawnRep)malloc(sizeof(*lawn));
   if (!lawn)
     ERROR("malloc() failed");
+  mem_add(MemLawn, sizeof(*lawn));
+
+  // give it a handle
+  pthread_mutex_lock(&lawns.lock);
+  lawn->handle = 0;
+  while (lawn->handle < LAWNS && lawns.rep[lawn->handle])
+    lawn->handle++;
+  if (lawn->handle == LAWNS)
+    ERROR("more than %d lawns", LAWNS);
+  lawns.rep[lawn->handle] = lawn;
+  pthread_mutex_unlock(&lawns.lock);
 
   // initialize new LawnRep with vals
   lawn->lawnsize = lawnsize;
   lawn->molesize = molesize;
+  lawn->quantum = 20; // vims up to 5.1s, as the default 1s..5s
+  lawn->hurry = 0;
+  lawn->quit = 0;
+  lawn->backend = backend;
+  lawn->out = strdup(out ? out : "");
+  lawn->period_ms = period_ms;
+  lawn->grid = grid_new(lawnsize, molesize);
 
   // create new window of calculated sizes for lawn
-  lawn->window = lawnimp_new(lawnsize, molesize);
+  lawn->window = lawnimp_new(lawn);
+
+  // a simulated text lawn has nothing to run, and no thread outside the simulation
+  if (backend == LawnText && vclock_running())
+    return lawn;
 
   // declare and initialize thread attributes
   pthread_attr_t tattr;
@@ -93,7 +179,33 @@ extern Lawn lawn_new(int lawnsize, int molesize)
 }
 
 /**
- * Frees up the resources held by a Lawn object and cancels its associated thread.
+ * Sets the unit of its moles' vims, which are stored in a byte each, to
+ * fit the longest: a vim is kept to within half a unit, and one longer
+ * than 255 units is cut to that. Call it before making moles.
+ *
+ * @param l the lawn.
+ * @param vimhi the longest vim, in ms.
+ */
+extern void lawn_vims(Lawn l, int vimhi)
+{
+  LawnRep r = (LawnRep)l;
+  r->quantum = vimhi > 255 ? (vimhi + 254) / 255 : 1;
+}
+
+/**
+ * Ends the delays of the lawn's moles, for a shutdown that cannot wait
+ * for them: a mole being created, whacked or expired is, at once, and
+ * later ones take no time. The lawn is otherwise unchanged.
+ *
+ * @param l the lawn.
+ */
+extern void lawn_hurry(Lawn l)
+{
+  lawnimp_hurry((LawnRep)l);
+}
+
+/**
+ * Frees up the resources held by a Lawn object and joins its associated thread.
  *
  * @param l A Lawn object to be freed.
  *
@@ -101,9 +213,87 @@ extern Lawn lawn_new(int lawnsize, int molesize)
 extern void lawn_free(Lawn l)
 {
   LawnRep r = (LawnRep)l;
-  lawnimp_free(r->window);
-  pthread_cancel(r->thread);
-  if (pthread_join(r->thread, 0))
+  // each backend's thread returns by itself once told to
+  lawnimp_free(r);
+  if (!(r->backend == LawnText && vclock_running()) && pthread_join(r->thread, 0))
     ERROR("pthread_join() failed: %s", strerror(errno));
+  if (r->backend == LawnRaster)
+    raster_free(r->window);
+  if (r->backend == LawnShm)
+    publish_free(r->window);
+  grid_free(r->grid);
+  pthread_mutex_lock(&lawns.lock);
+  lawns.rep[r->handle] = 0;
+  pthread_mutex_unlock(&lawns.lock);
+  mem_add(MemLawn, -(long)sizeof(*r));
+  free(r->out);
   free(r);
 }
+
+/**
+ * Claims a free cell of the lawn's spatial index for a new mole.
+ * The cell under (*x,*y) is tried first, then a few random cells, then
+ * every cell in order, so spawning stays cheap until the lawn is nearly full.
+ *
+ * @param l the lawn.
+ * @param x in: preferred x; out: x of the claimed cell.
+ * @param y in: preferred y; out: y of the claimed cell.
+ * @param d the occupant recorded in the cell.
+ *
+ * @return 1 if a cell was claimed; 0 if the lawn is full.
+ */
+extern int lawn_place(Lawn l, int *x, int *y, void *d)
+{
+  LawnRep r = (LawnRep)l;
+  int cells = grid_cells(r->grid);
+  int c = grid_cell(r->grid, *x, *y);
+
+  int claimed = grid_claim(r->grid, c, d);
+  for (int i = 0; i < 4 && !claimed; i++)
+  {
+    c = random() % cells;
+    claimed = grid_claim(r->grid, c, d);
+  }
+
+  // random probes failed, so scan every cell once
+  for (int i = 0; i < cells && !claimed; i++)
+  {
+    c = (c + 1) % cells;
+    claimed = grid_claim(r->grid, c, d);
+  }
+  if (!claimed)
+    return 0;
+
+  grid_xy(r->grid, c, x, y);
+  return 1;
+}
+
+/**
+ * Releases the cell held by a mole at (x,y). Harmless if the mole
+ * never claimed a cell, since another occupant is left alone.
+ */
+extern void lawn_leave(Lawn l, int x, int y, void *d)
+{
+  LawnRep r = (LawnRep)l;
+  grid_release(r->grid, grid_cell(r->grid, x, y), d);
+}
+
+/* Returns the mole covering pixel (x,y), or 0 if there is none */
+extern void *lawn_mole_at(Lawn l, int x, int y)
+{
+  LawnRep r = (LawnRep)l;
+  return grid_at(r->grid, grid_cell(r->grid, x, y));
+}
+
+/* Returns 1 iff the cell covering pixel (x,y) holds a mole */
+extern int lawn_occupied(Lawn l, int x, int y)
+{
+  return lawn_mole_at(l, x, y) != 0;
+}
+
+/* Returns the number of moles holding cells */
+extern int lawn_live(Lawn l)
+{
+  LawnRep r = (LawnRep)l;
+  return grid_live(r->grid);
+}
@@ -3,7 +3,29 @@
 
 typedef void *Lawn;
 
-extern Lawn lawn_new(int lawnsize, int molesize);
+// How a lawn shows its moles: LawnAuto is FLTK if DISPLAY is set, else
+// text. LawnRaster draws into a framebuffer (raster.h), rendering a frame
+// each period and writing it to out, if that is not empty. LawnShm
+// publishes the lawn each period to the shared-memory ring named out
+// (publish.h), for a viewer process (view/).
+typedef enum {LawnAuto, LawnText, LawnFltk, LawnRaster, LawnShm} LawnBackend;
+
+extern Lawn lawn_new(int lawnsize, int molesize); // LawnAuto
+extern Lawn lawn_open(int lawnsize, int molesize, LawnBackend backend,
+                      const char *out, int period_ms);
+extern LawnBackend lawn_backend(const char *name);
+extern void lawn_vims(Lawn l, int vimhi); // the longest vim, in ms, its moles keep exactly enough
+extern void lawn_hurry(Lawn l); // its moles' delays end now, and from now on take none
 extern void lawn_free(Lawn l);
 
+// Spatial index of live moles: one mole per molesize-by-molesize cell.
+// place() claims the cell at (*x,*y), or another free one, for d and
+// moves (*x,*y) onto it; it returns 0, leaving (*x,*y) as is, if the
+// lawn is full. leave() frees d's cell. Queries are O(1) and lock-free.
+extern int   lawn_place(Lawn l, int *x, int *y, void *d);
+extern void  lawn_leave(Lawn l, int x, int y, void *d);
+extern void *lawn_mole_at(Lawn l, int x, int y);
+extern int   lawn_occupied(Lawn l, int x, int y);
+extern int   lawn_live(Lawn l);
+
 #endif
@@ -2,7 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/syscall.h>
+#include <errno.h>
 
 #include <FL/Fl.H>
 #include <FL/Fl_Window.H>
@@ -11,108 +11,377 @@
 #define LAWNIMP
 #include "lawnimp.h"
 #undef LAWNIMP
+#include "rec.h"
+#include "log.h"
+#include "metrics.h"
+#include "now.h"
+#include "trace.h"
+#include "raster.h"
+#include "publish.h"
+#include "vclock.h"
+#include "prof.h"
+#include "mem.h"
 
 using namespace std;
 
 // Plain sleep(3) may be implemented using alarm(2) and SIGALRM.
 // Signals have process, not thread, granularity.
-// So, we use pthread_cond_timedwait(3).
-// Perhaps, usleep(3) or nanosleep(3) would be better.
-static void tsleep(int secs) {
-  pthread_mutex_t mutex;
-  pthread_cond_t cv;
-  pthread_mutex_init(&mutex,0);
-  pthread_cond_init(&cv,0);
+// So, we use pthread_cond_timedwait(3), on a cond every sleeper shares,
+// so lawnimp_hurry() can end every sleep at once.
+static pthread_mutex_t sleepers=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hurried=PTHREAD_COND_INITIALIZER;
 
+static void tsleep(LawnRep l, int ms) {
+  TRACE_SCOPE("tsleep");
+  if (__atomic_load_n(&l->hurry,__ATOMIC_ACQUIRE)) return;
+  if (vclock_sleep_until(now_ns()+ms*1000000ULL)) return; // simulated
   struct timespec t;
   clock_gettime(CLOCK_REALTIME,&t);
-  t.tv_sec+=secs;
-  pthread_mutex_lock(&mutex);
-  pthread_cond_timedwait(&cv,&mutex,&t);
-  pthread_mutex_unlock(&mutex);
+  t.tv_sec+=ms/1000;
+  t.tv_nsec+=(ms%1000)*1000000L;
+  if (t.tv_nsec>=1000000000L) { t.tv_sec++; t.tv_nsec-=1000000000L; }
+  pthread_mutex_lock(&sleepers);
+  while (!l->hurry && pthread_cond_timedwait(&hurried,&sleepers,&t)!=ETIMEDOUT)
+    ;
+  pthread_mutex_unlock(&sleepers);
+}
+
+extern LINKAGE void lawnimp_hurry(LawnRep l) {
+  pthread_mutex_lock(&sleepers);
+  __atomic_store_n(&l->hurry,1,__ATOMIC_RELEASE);
+  pthread_cond_broadcast(&hurried);
+  pthread_mutex_unlock(&sleepers);
+}
 
-  pthread_mutex_destroy(&mutex);
-  pthread_cond_destroy(&cv);
+// Fl::lock(), timing the wait for the metrics endpoint.
+static void fllock() {
+  TRACE_SCOPE("Fl::lock");
+  PROF_SCOPE("Fl::lock");
+  uint64_t t0=now_ns();
+  Fl::lock();
+  OBSERVE("wam_fltk_lock_wait_seconds","time spent waiting for the FLTK lock",now_ns()-t0);
 }
 
-static int text() {
-  char* v=getenv("DISPLAY");
-  return !(v && *v);
+static int text(LawnRep l) { return l->backend==LawnText; }
+// Raster and shm lawns keep a state per cell, set without delay or lock
+static int headless(LawnRep l) { return l->backend==LawnRaster || l->backend==LawnShm; }
+static void cell(LawnRep l, int x, int y, RasterState s) {
+  if (l->backend==LawnRaster) raster_set(l->window,x,y,s);
+  else publish_set(l->window,x,y,s);
 }
 
-#define gettid() ((pid_t)syscall(SYS_gettid))
-#define WR(X,Y,MSG) printf("(%d,%d) %d %s %s\n",X,Y, gettid(), __func__,MSG)
+#if LOG_LEVEL <= LOG_INFO
+#define WR(X,Y,MSG) log_msg(1,"(%d,%d) %d %s %s",X,Y, vclock_tid(), __func__,MSG)
+#else
+#define WR(X,Y,MSG) do {} while (0)
+#endif
 #define WR0 { WR(0,0,""); return 0; }
+#define REC(E,M) rec_event(E,(M)->id,(M)->x,(M)->y)
+#define RECI(E,B,I) rec_event(E,(B)->id+(I),(B)->x[I],(B)->y[I])
 
-extern LINKAGE void* lawnimp_new(int lawnsize, int molesize) {
-  if (text()) WR0;
-  int size=lawnsize*molesize;
+extern LINKAGE void* lawnimp_new(LawnRep l) {
+  if (text(l)) WR0;
+  if (l->backend==LawnRaster) return raster_new(l->lawnsize,l->molesize);
+  if (l->backend==LawnShm) return publish_new(l->out,l->lawnsize,l->molesize);
+  int size=l->lawnsize*l->molesize;
   Fl_Window* w=new Fl_Window(size,size);
   w->end();
   w->show();
-  Fl::lock();
+  fllock();
   return w;
 }
 
 extern LINKAGE void* lawnimp_run(LawnRep l) {
-  if (text()) WR0;
-  Fl::run();
+  if (text(l)) WR0;
+  if (l->backend==LawnRaster) {
+    raster_run(l->window,l->out,l->period_ms);
+    return 0;
+  }
+  if (l->backend==LawnShm) {
+    publish_run(l->window,l->period_ms);
+    return 0;
+  }
+  // Fl::run(), until lawnimp_free() wakes it to return
+  while (!__atomic_load_n(&l->quit,__ATOMIC_ACQUIRE) && Fl::first_window())
+    Fl::wait();
   return 0;
 }
 
-extern LINKAGE void* lawnimp_mole(MoleRep m) {
-  if (text()) {
-    WR(m->x,m->y,"creating");
-    tsleep(m->vim0);
-    WR(m->x,m->y,"created");
+// Shows a created mole on a raster, shm or FLTK lawn
+static void* show(LawnRep l, MoleRep m) {
+  if (headless(l)) {
+    cell(l,m->x,m->y,RasterGreen);
+    REC(RecCreated,m);
     return 0;
   }
-  LawnRep l=(LawnRep)m->lawn;
   Fl_Window* w=(Fl_Window*)l->window;
-  tsleep(m->vim0);
-  Fl::lock();
+  PROF_SCOPE("fltk mole");
+  fllock();
   w->begin();
-  Fl_Box* b=new Fl_Box(m->x,m->y,m->size,m->size);
+  Fl_Box* b=new Fl_Box(m->x,m->y,l->molesize,l->molesize);
+  mem_add(MemWidgets,sizeof(Fl_Box));
   b->box(FL_OVAL_BOX);
   b->color(FL_GREEN);
   w->end();
   w->redraw();
   Fl::check();
   Fl::unlock();
+  REC(RecCreated,m);
   return b;
 }
 
-extern LINKAGE void lawnimp_whack(MoleRep m) {
-  if (text()) {
+extern LINKAGE void* lawnimp_mole(MoleRep m) {
+  LawnRep l=MOLE_LAWN(m);
+  REC(RecCreating,m);
+  if (text(l)) {
+    WR(m->x,m->y,"creating");
+    tsleep(l,MOLE_MS(l,m->vim0));
+    WR(m->x,m->y,"created");
+    REC(RecCreated,m);
+    return 0;
+  }
+  tsleep(l,MOLE_MS(l,m->vim0));
+  return show(l,m);
+}
+
+// A restored mole is shown at once: it was created before its snapshot
+extern LINKAGE void* lawnimp_show(MoleRep m) {
+  LawnRep l=MOLE_LAWN(m);
+  if (text(l)) {
+    WR(m->x,m->y,"restored");
+    REC(RecCreated,m);
+    return 0;
+  }
+  return show(l,m);
+}
+
+extern LINKAGE void lawnimp_hit(MoleRep m) {
+  LawnRep l=MOLE_LAWN(m);
+  REC(RecWhacking,m);
+  if (text(l)) {
     WR(m->x,m->y,"whacking");
-    tsleep(m->vim1);
+    tsleep(l,MOLE_MS(l,m->vim1));
     WR(m->x,m->y,"whacked");
-    tsleep(m->vim2);
-    WR(m->x,m->y,"expired");
+    REC(RecWhacked,m);
+    return;
+  }
+  tsleep(l,MOLE_MS(l,m->vim1));
+  if (headless(l)) {
+    cell(l,m->x,m->y,RasterRed);
+    REC(RecWhacked,m);
     return;
   }
-  LawnRep l=(LawnRep)m->lawn;
   Fl_Window* w=(Fl_Window*)l->window;
   Fl_Box* b=(Fl_Box*)m->box;
-  tsleep(m->vim1);
-  Fl::lock();
+  PROF_SCOPE("fltk hit");
+  fllock();
   b->color(FL_RED);
   w->redraw();
   Fl::check();
   Fl::unlock();
-  tsleep(m->vim2);
-  Fl::lock();
+  REC(RecWhacked,m);
+}
+
+extern LINKAGE void lawnimp_expire(MoleRep m) {
+  LawnRep l=MOLE_LAWN(m);
+  if (text(l)) {
+    tsleep(l,MOLE_MS(l,m->vim2));
+    WR(m->x,m->y,"expired");
+    REC(RecExpired,m);
+    return;
+  }
+  tsleep(l,MOLE_MS(l,m->vim2));
+  if (headless(l)) {
+    cell(l,m->x,m->y,RasterNone);
+    REC(RecExpired,m);
+    return;
+  }
+  Fl_Window* w=(Fl_Window*)l->window;
+  Fl_Box* b=(Fl_Box*)m->box;
+  PROF_SCOPE("fltk expire");
+  fllock();
   b->hide();
   w->redraw();
   Fl::check();
   Fl::unlock();
   w->remove(b);
   delete b;
+  mem_add(MemWidgets,-(long)sizeof(Fl_Box));
+  REC(RecExpired,m);
 }
 
-extern LINKAGE void lawnimp_free(void* w) {
-  Fl::lock();
-  delete (Fl_Window*)w;
+extern LINKAGE void lawnimp_whack(MoleRep m) {
+  lawnimp_hit(m);
+  lawnimp_expire(m);
+}
+
+// Removes a mole that will never be whacked, without delay
+extern LINKAGE void lawnimp_discard(MoleRep m) {
+  LawnRep l=MOLE_LAWN(m);
+  if (text(l)) {
+    WR(m->x,m->y,"discarded");
+    REC(RecDiscarded,m);
+    return;
+  }
+  if (headless(l)) {
+    cell(l,m->x,m->y,RasterNone);
+    REC(RecDiscarded,m);
+    return;
+  }
+  Fl_Window* w=(Fl_Window*)l->window;
+  Fl_Box* b=(Fl_Box*)m->box;
+  if (!b) {
+    // never created
+    REC(RecDiscarded,m);
+    return;
+  }
+  PROF_SCOPE("fltk discard");
+  fllock();
+  b->hide();
+  w->remove(b);
+  w->redraw();
+  Fl::check();
+  Fl::unlock();
+  delete b;
+  mem_add(MemWidgets,-(long)sizeof(Fl_Box));
+  REC(RecDiscarded,m);
+}
+
+// Tears down the display; a raster or shm thread does one more period and
+// returns, and the FLTK thread is woken to return
+extern LINKAGE void lawnimp_free(LawnRep l) {
+  if (text(l)) return;
+  if (l->backend==LawnRaster) {
+    raster_stop(l->window);
+    return;
+  }
+  if (l->backend==LawnShm) {
+    publish_stop(l->window);
+    return;
+  }
+  fllock();
+  delete (Fl_Window*)l->window;
+  __atomic_store_n(&l->quit,1,__ATOMIC_RELEASE);
+  Fl::awake();
   Fl::check();
   Fl::unlock();
 }
+
+// A batch shares one create delay and one whack/expire delay: the
+// longest of its moles, so every mole lives at least its own vims.
+static int vimmax(LawnRep l, uint8_t* v, int n) {
+  int m=0;
+  for (int i=0; i<n; i++)
+    if (v[i]>m) m=v[i];
+  return MOLE_MS(l,m);
+}
+
+extern LINKAGE void lawnimp_batch(MoleBatchRep b) {
+  LawnRep l=MOLE_LAWN(b);
+  for (int i=0; i<b->n; i++) RECI(RecCreating,b,i);
+  if (text(l)) {
+    for (int i=0; i<b->n; i++) WR(b->x[i],b->y[i],"creating");
+    tsleep(l,vimmax(l,b->vim0,b->n));
+    for (int i=0; i<b->n; i++) { WR(b->x[i],b->y[i],"created"); RECI(RecCreated,b,i); b->box[i]=0; }
+    return;
+  }
+  tsleep(l,vimmax(l,b->vim0,b->n));
+  if (headless(l)) {
+    for (int i=0; i<b->n; i++) { cell(l,b->x[i],b->y[i],RasterGreen); RECI(RecCreated,b,i); b->box[i]=0; }
+    return;
+  }
+  Fl_Window* w=(Fl_Window*)l->window;
+  PROF_SCOPE("fltk batch");
+  fllock();
+  w->begin();
+  for (int i=0; i<b->n; i++) {
+    Fl_Box* box=new Fl_Box(b->x[i],b->y[i],l->molesize,l->molesize);
+    mem_add(MemWidgets,sizeof(Fl_Box));
+    box->box(FL_OVAL_BOX);
+    box->color(FL_GREEN);
+    b->box[i]=box;
+  }
+  w->end();
+  w->redraw();
+  Fl::check();
+  Fl::unlock();
+  for (int i=0; i<b->n; i++) RECI(RecCreated,b,i);
+}
+
+extern LINKAGE void lawnimp_batch_whack(MoleBatchRep b) {
+  LawnRep l=MOLE_LAWN(b);
+  for (int i=0; i<b->n; i++) RECI(RecWhacking,b,i);
+  if (text(l)) {
+    for (int i=0; i<b->n; i++) WR(b->x[i],b->y[i],"whacking");
+    tsleep(l,vimmax(l,b->vim1,b->n));
+    for (int i=0; i<b->n; i++) { WR(b->x[i],b->y[i],"whacked"); RECI(RecWhacked,b,i); }
+    tsleep(l,vimmax(l,b->vim2,b->n));
+    for (int i=0; i<b->n; i++) { WR(b->x[i],b->y[i],"expired"); RECI(RecExpired,b,i); }
+    return;
+  }
+  if (headless(l)) {
+    tsleep(l,vimmax(l,b->vim1,b->n));
+    for (int i=0; i<b->n; i++) { cell(l,b->x[i],b->y[i],RasterRed); RECI(RecWhacked,b,i); }
+    tsleep(l,vimmax(l,b->vim2,b->n));
+    for (int i=0; i<b->n; i++) { cell(l,b->x[i],b->y[i],RasterNone); RECI(RecExpired,b,i); }
+    return;
+  }
+  Fl_Window* w=(Fl_Window*)l->window;
+  tsleep(l,vimmax(l,b->vim1,b->n));
+  {
+    PROF_SCOPE("fltk batch hit");
+    fllock();
+    for (int i=0; i<b->n; i++) ((Fl_Box*)b->box[i])->color(FL_RED);
+    w->redraw();
+    Fl::check();
+    Fl::unlock();
+  }
+  for (int i=0; i<b->n; i++) RECI(RecWhacked,b,i);
+  tsleep(l,vimmax(l,b->vim2,b->n));
+  {
+    PROF_SCOPE("fltk batch expire");
+    fllock();
+    for (int i=0; i<b->n; i++) ((Fl_Box*)b->box[i])->hide();
+    w->redraw();
+    Fl::check();
+    Fl::unlock();
+  }
+  for (int i=0; i<b->n; i++) {
+    Fl_Box* box=(Fl_Box*)b->box[i];
+    w->remove(box);
+    delete box;
+    mem_add(MemWidgets,-(long)sizeof(Fl_Box));
+    RECI(RecExpired,b,i);
+  }
+}
+
+// Removes a batch that will never be whacked, without delay
+extern LINKAGE void lawnimp_batch_discard(MoleBatchRep b) {
+  LawnRep l=MOLE_LAWN(b);
+  if (text(l)) {
+    for (int i=0; i<b->n; i++) { WR(b->x[i],b->y[i],"discarded"); RECI(RecDiscarded,b,i); }
+    return;
+  }
+  if (headless(l)) {
+    for (int i=0; i<b->n; i++) { cell(l,b->x[i],b->y[i],RasterNone); RECI(RecDiscarded,b,i); }
+    return;
+  }
+  Fl_Window* w=(Fl_Window*)l->window;
+  PROF_SCOPE("fltk batch discard");
+  fllock();
+  for (int i=0; i<b->n; i++)
+    if (b->box[i]) {
+      ((Fl_Box*)b->box[i])->hide();
+      w->remove((Fl_Box*)b->box[i]);
+    }
+  w->redraw();
+  Fl::check();
+  Fl::unlock();
+  for (int i=0; i<b->n; i++) {
+    if (b->box[i]) {
+      delete (Fl_Box*)b->box[i];
+      mem_add(MemWidgets,-(long)sizeof(Fl_Box));
+    }
+    RECI(RecDiscarded,b,i);
+  }
+}
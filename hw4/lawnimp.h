@@ -5,29 +5,68 @@
 #error Do not #include this file, directly.
 #endif
 
+#include <stdint.h>
 #include <pthread.h>
 
 #include "linkage.h"
+#include "lawn.h"
 
 typedef struct {
+  int handle;          // what its moles hold: lawn_rep(handle) is this
   int lawnsize;
-  int molesize;
-  void *window;
+  int molesize;        // every mole's size
+  int quantum;         // ms per unit of a mole's vims
+  int hurry;           // set by lawn_hurry: delays end at once
+  int quit;            // LawnFltk: the event loop returns
+  LawnBackend backend; // never LawnAuto
+  char *out;           // LawnRaster: where to write frames; LawnShm: ring name
+  int period_ms;       // LawnRaster, LawnShm: frame period
+  void *window;        // Fl_Window, Raster, or Publish
+  void *grid;
   pthread_t thread;
 } *LawnRep;
 
+// Packed, for millions of live moles: 24 bytes, from a slab. Positions
+// are pixels; vims are in units of the lawn's quantum (MOLE_MS).
 typedef struct {
-  int size;
-  int x,y;
-  int vim0,vim1,vim2;
-  void *lawn;
+  uint32_t id;
+  uint16_t x,y;
+  uint8_t vim0,vim1,vim2;
+  uint8_t lawn;        // handle
   void *box;
 } *MoleRep;
 
-extern LINKAGE void* lawnimp_new(int lawnsize, int molesize);
+#define LAWNS 256      // lawns open at once, as many as a handle can name
+
+extern LINKAGE LawnRep lawn_rep(int handle);
+
+#define MOLE_LAWN(m) lawn_rep((m)->lawn)
+#define MOLE_MS(l,v) ((v)*(l)->quantum)
+
+// struct-of-arrays: one allocation holds the header and all n-element
+// arrays, in a MoleRep's units: pixel positions, and vims in quanta
+typedef struct {
+  int n;
+  uint32_t id;         // ids run from id to id+n-1
+  uint16_t *x,*y;
+  uint8_t *vim0,*vim1,*vim2;
+  uint8_t lawn;        // handle
+  void **box;
+} *MoleBatchRep;
+
+extern LINKAGE void* lawnimp_new(LawnRep l);
 extern LINKAGE void* lawnimp_run(LawnRep l);
 extern LINKAGE void* lawnimp_mole(MoleRep m);
-extern LINKAGE void  lawnimp_whack(MoleRep m);
-extern LINKAGE void  lawnimp_free(void* w);
+extern LINKAGE void* lawnimp_show(MoleRep m);
+extern LINKAGE void  lawnimp_whack(MoleRep m);  // hit, then expire
+extern LINKAGE void  lawnimp_hit(MoleRep m);
+extern LINKAGE void  lawnimp_expire(MoleRep m);
+extern LINKAGE void  lawnimp_discard(MoleRep m);
+extern LINKAGE void  lawnimp_hurry(LawnRep l);
+extern LINKAGE void  lawnimp_free(LawnRep l);
+
+extern LINKAGE void  lawnimp_batch(MoleBatchRep b);
+extern LINKAGE void  lawnimp_batch_whack(MoleBatchRep b);
+extern LINKAGE void  lawnimp_batch_discard(MoleBatchRep b);
 
 #endif
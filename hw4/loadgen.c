@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "loadgen.h"
+#include "mole.h"
+#include "mtq.h"
+#include "threads.h"
+#include "hist.h"
+#include "now.h"
+#include "stop.h"
+#include "error.h"
+
+typedef enum {Constant, Poisson, Bursty} Arrival;
+
+// A queued mole and the time it was due
+typedef struct {
+  Mole m;
+  uint64_t due;
+} Job;
+
+// State shared by every load generator thread
+typedef struct {
+  Config *c;
+  Mtq q;
+  Lawn l;
+  Arrival arrival;
+  int wait;             // the overflow policy waits for room, so puts must not use it
+  uint64_t start, end;  // end is 0 without a duration
+  long left;            // moles still to make, if c->moles
+  int next;             // producer numbering
+  int done;             // consumers have finished
+  int stopping;         // signalled: arrive no more
+  int discard;          // signalled: shed queued moles instead of whacking them
+  uint64_t made, late;  // moles made; and made over 1 ms after due
+  uint64_t refused;     // moles a full queue refused, where the policy would wait
+  uint64_t lag;         // most a mole was made after it was due
+  Hist whack, whack_all; // due to whacking: this interval, and in total
+  Hist life, life_all;   // due to expired: this interval, and in total
+} Load;
+
+/**
+ * Returns the due time of a producer's k-th arrival. Each of n producers
+ * runs its own process at rate/n, so together they arrive at rate.
+ *
+ * @param g    the load.
+ * @param prev this producer's previous due time, as an offset from start.
+ * @param k    arrival number, from 0.
+ * @param i    producer number.
+ * @param xs   this producer's erand48() state.
+ *
+ * @return the due time, as an offset from start.
+ */
+static double due(Load *g, double prev, long k, int i, unsigned short xs[3]) {
+  int n = g->c->producers;
+  double gap = 1e9 * n / g->c->rate;
+  switch (g->arrival) {
+  case Constant:
+    // producers are staggered evenly across one gap
+    return k ? prev + gap : gap * i / n;
+  case Poisson:
+    return prev - log(1 - erand48(xs)) * gap;
+  case Bursty: {
+    // arrive at rate/duty while on, counting only on-time, then map
+    // on-time onto wall time
+    double period = g->c->burst_period * 1e6;
+    double on = period * g->c->burst_duty;
+    double t = (k + (double)i / n) * gap * g->c->burst_duty;
+    return floor(t / on) * period + fmod(t, on);
+  }
+  }
+  return prev;
+}
+
+/* Frees a job that will not be whacked: refused, evicted, or left over */
+static void shed(Data d) {
+  Job *j = d;
+  if (!j)
+    return;
+  mole_discard(j->m);
+  free(j);
+}
+
+/*
+ * Producer: makes a mole at each due time, however late it already is.
+ * It only generates the mole, and puts it without waiting, so arrivals
+ * keep to their schedule; consumers pay the create delay.
+ */
+static void *produce(void *a) {
+  Load *g = a;
+  int i = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED);
+  long seed = g->c->seed;
+  unsigned short xs[3] = {(unsigned short)seed, (unsigned short)(seed >> 16), (unsigned short)i};
+  double t = 0;
+  for (long k = 0;; k++) {
+    t = due(g, t, k, i, xs);
+    uint64_t at = g->start + (uint64_t)t;
+    if (g->end && at >= g->end)
+      break;
+    if (g->c->moles && __atomic_sub_fetch(&g->left, 1, __ATOMIC_RELAXED) < 0)
+      break;
+    if (nap_until(at, &g->stopping))
+      break;
+    uint64_t lag = now_ns() - at;
+    if (lag > 1000000)
+      __atomic_add_fetch(&g->late, 1, __ATOMIC_RELAXED);
+    uint64_t m = __atomic_load_n(&g->lag, __ATOMIC_RELAXED);
+    while (lag > m && !__atomic_compare_exchange_n(&g->lag, &m, lag, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+    Job *j = malloc(sizeof(*j));
+    if (!j) ERROR("malloc() failed");
+    j->due = at;
+    j->m = mole_gen(g->l, g->c->vimlo, g->c->vimhi);
+    MtqStatus s = g->wait ? mtq_tail_tryput(g->q, j) : mtq_tail_put(g->q, j);
+    if (g->wait && s == MtqFull)
+      __atomic_add_fetch(&g->refused, 1, __ATOMIC_RELAXED);
+    if (s == MtqFull || s == MtqTimedOut || s == MtqClosed)
+      shed(j);
+    __atomic_add_fetch(&g->made, 1, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/* Consumer: shows and whacks moles until it takes a 0, or sheds them, once a stop says to */
+static void *consume(void *a) {
+  Load *g = a;
+  Job *j;
+  while ((j = mtq_head_get(g->q))) {
+    if (__atomic_load_n(&g->discard, __ATOMIC_ACQUIRE)) {
+      shed(j);
+      continue;
+    }
+    mole_create(j->m);
+    hist_add(g->whack, now_ns() - j->due);
+    mole_whack(j->m);
+    hist_add(g->life, now_ns() - j->due);
+    free(j);
+  }
+  return 0;
+}
+
+static void line(const char *what, Hist h) {
+  log_msg(2, "%s: n=%lu mean=%.3fms p50=%.3fms p90=%.3fms p99=%.3fms p99.9=%.3fms max=%.3fms",
+          what, (unsigned long)hist_count(h), hist_mean(h) / 1e6,
+          hist_pct(h, 50) / 1e6, hist_pct(h, 90) / 1e6, hist_pct(h, 99) / 1e6,
+          hist_pct(h, 99.9) / 1e6, hist_max(h) / 1e6);
+}
+
+/* Monitor: reports each interval's progress and latency */
+static void *monitor(void *a) {
+  Load *g = a;
+  for (uint64_t t = g->start + g->c->report * 1000000ULL;
+       !__atomic_load_n(&g->done, __ATOMIC_ACQUIRE); t += g->c->report * 1000000ULL) {
+    if (nap_until(t, &g->done))
+      break;
+    MtqStats s;
+    mtq_stats(g->q, &s);
+    log_msg(2, "loadgen: t=%.1fs made=%lu late=%lu shed=%lu queued=%d capacity=%d",
+            (t - g->start) / 1e9, (unsigned long)g->made, (unsigned long)g->late,
+            s.rejected + s.dropped_newest + s.dropped_oldest + s.timeouts + g->refused, mtq_len(g->q), s.capacity);
+    line("  whack", g->whack);
+    hist_move(g->whack_all, g->whack);
+    hist_move(g->life_all, g->life);
+  }
+  return 0;
+}
+
+/*
+ * Stops the load, on a signal: arrivals end, and the queue is closed, so
+ * consumers finish what is queued, or, under the discard policy or when
+ * the stop runs late, shed it, with the delays of moles in flight hurried.
+ */
+static void stopped(void *a, int hard) {
+  Load *g = a;
+  __atomic_store_n(&g->stopping, 1, __ATOMIC_RELEASE);
+  if (hard || !strcmp(g->c->stop_policy, "discard")) {
+    __atomic_store_n(&g->discard, 1, __ATOMIC_RELEASE);
+    lawn_hurry(g->l);
+  }
+  mtq_close(g->q);
+}
+
+/**
+ * Runs open-loop load through a queue and lawn, and reports latency.
+ *
+ * @param c the configuration; c->rate must be positive.
+ * @param l the lawn.
+ */
+extern void loadgen(Config *c, Lawn l) {
+  Load g = {c, mtq_new_policy(c->mtqmax, mtq_policy(c->policy), shed, c->put_timeout), l};
+  if (!strcmp(c->arrival, "constant"))
+    g.arrival = Constant;
+  else if (!strcmp(c->arrival, "poisson"))
+    g.arrival = Poisson;
+  else if (!strcmp(c->arrival, "bursty"))
+    g.arrival = Bursty;
+  else
+    ERROR("unknown arrival distribution: %s", c->arrival);
+  if (!c->duration && !c->moles)
+    ERROR("open-loop load needs a duration or a mole count");
+  MtqPolicy policy = mtq_policy(c->policy);
+  g.wait = policy == MtqBlock || policy == MtqTimeout;
+  if (c->adapt_max)
+    mtq_adapt(g.q, c->adapt_min, c->adapt_max, c->adapt_target, c->adapt_interval);
+
+  g.whack = hist_new();
+  g.whack_all = hist_new();
+  g.life = hist_new();
+  g.life_all = hist_new();
+  g.left = c->moles;
+  g.start = now_ns();
+  g.end = c->duration ? g.start + c->duration * 1000000ULL : 0;
+
+  stop_on(stopped, &g, c->stop_budget);
+  pthread_t *mon = c->report ? create_individual_thread(monitor, &g) : 0;
+  pthread_t **producers = create_threads(produce, c->producers, &g);
+  pthread_t **consumers = create_threads(consume, c->consumers, &g);
+  wait_threads(producers, c->producers);
+  double arriving = (now_ns() - g.start) / 1e9;
+  for (int i = 0; i < c->consumers; i++)
+    mtq_tail_put_wait(g.q, 0);
+  wait_threads(consumers, c->consumers);
+  stop_on(0, 0, 0);
+  double secs = (now_ns() - g.start) / 1e9;
+  __atomic_store_n(&g.done, 1, __ATOMIC_RELEASE);
+  if (mon)
+    wait_individual_thread(mon);
+
+  hist_move(g.whack_all, g.whack);
+  hist_move(g.life_all, g.life);
+  MtqStats s;
+  mtq_stats(g.q, &s);
+  log_msg(2, "loadgen: %s arrivals at %g/s for %.1fs (%.1fs to drain): made=%lu (%.1f/s) late=%lu maxlag=%.3fms",
+          c->arrival, c->rate, arriving, secs - arriving, (unsigned long)g.made, g.made / arriving,
+          (unsigned long)g.late, g.lag / 1e6);
+  if (g.wait)
+    log_msg(2, "loadgen: %s shed refused=%lu (the queue was full)", c->policy, (unsigned long)g.refused);
+  else
+    log_msg(2, "loadgen: %s shed rejected=%lu dropped-newest=%lu dropped-oldest=%lu",
+            c->policy, s.rejected, s.dropped_newest, s.dropped_oldest);
+  if (s.decisions)
+    log_msg(2, "loadgen: capacity=%d decisions=%lu grown=%lu shrunk=%lu; last: sojourn=%.3fms standing=%.3fms put-wait=%.2f get-wait=%.2f",
+            s.capacity, s.decisions, s.grown, s.shrunk, s.sojourn_ms, s.standing_ms, s.put_wait, s.get_wait);
+  line("loadgen: due to whacking", g.whack_all);
+  line("loadgen: due to expired", g.life_all);
+  hist_free(g.whack);
+  hist_free(g.whack_all);
+  hist_free(g.life);
+  hist_free(g.life_all);
+  mtq_del(g.q, shed);
+}
@@ -0,0 +1,20 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include "config.h"
+#include "lawn.h"
+
+// Open-loop load: producers put moles on the queue at scheduled arrival
+// times (constant, Poisson, or bursty at c->rate per second), whether or
+// not consumers keep up. Latency runs from each mole's scheduled arrival,
+// not from when a producer got to it, so it counts the time a stalled
+// system kept arrivals from being produced (coordinated omission).
+// Producers only generate moles and never wait for room: a full queue
+// sheds by its overflow policy, or, if that would wait (block, timeout),
+// refuses the mole; consumers pay the create delay. Shed moles are
+// counted, not measured. Runs for c->duration, or until c->moles moles
+// are made.
+
+extern void loadgen(Config *c, Lawn l);
+
+#endif
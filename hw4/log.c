@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "log.h"
+
+#define SLOTS 1024   // messages per thread ring, a power of two
+#define LINE  248    // bytes per message, including the newline
+#define IOVS  IOV_MAX
+
+typedef struct {
+  int fd;
+  int len;
+  char text[LINE];
+} Slot;
+
+// A thread's ring: only the owner advances head, only a drainer advances tail
+typedef struct Ring {
+  struct Ring *next;
+  unsigned head;
+  unsigned tail;
+  unsigned mark;     // head as of the drain in progress
+  int dead;          // owner has exited; free once drained
+  Slot slot[SLOTS];
+} *Ring;
+
+// Logger state: one per process
+static struct {
+  int on;
+  int keyed;            // key made and exit handler registered, once
+  int stop;
+  unsigned long dropped;
+  pthread_t drainer;
+  pthread_key_t key;
+  pthread_mutex_t lock; // guards rings, and serializes draining
+  pthread_cond_t kick;  // wakes the drainer early
+  Ring rings;
+} lg = {.lock = PTHREAD_MUTEX_INITIALIZER, .kick = PTHREAD_COND_INITIALIZER};
+
+static void writeall(int fd, const char *s, int len) {
+  while (len > 0) {
+    ssize_t n = write(fd, s, len);
+    if (n <= 0)
+      return;
+    s += n;
+    len -= n;
+  }
+}
+
+/**
+ * Writes every queued message with as few writev(2) calls as possible,
+ * one fd at a time, then frees the rings of exited threads.
+ * Caller holds lg.lock.
+ */
+static void drain() {
+  static struct iovec iov[IOVS];
+  for (Ring r = lg.rings; r; r = r->next)
+    r->mark = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  for (int fd = 1; fd <= 2; fd++) {
+    int n = 0;
+    for (Ring r = lg.rings; r; r = r->next) {
+      for (unsigned i = r->tail; i != r->mark; i++) {
+        Slot *s = &r->slot[i % SLOTS];
+        if (s->fd != fd)
+          continue;
+        if (n == IOVS) {
+          writev(fd, iov, n);
+          n = 0;
+        }
+        iov[n].iov_base = s->text;
+        iov[n].iov_len = s->len;
+        n++;
+      }
+    }
+    if (n)
+      writev(fd, iov, n);
+  }
+  // release the slots only after both passes have written them
+  for (Ring *p = &lg.rings; *p;) {
+    Ring r = *p;
+    __atomic_store_n(&r->tail, r->mark, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->mark) {
+      *p = r->next;
+      free(r);
+    } else
+      p = &r->next;
+  }
+}
+
+/* Background thread: drains every ring each few milliseconds, or when kicked */
+static void *drainer(void *a) {
+  pthread_mutex_lock(&lg.lock);
+  while (!lg.stop) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += 5000000;
+    if (t.tv_nsec >= 1000000000) {
+      t.tv_sec++;
+      t.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&lg.kick, &lg.lock, &t);
+    drain();
+  }
+  pthread_mutex_unlock(&lg.lock);
+  return 0;
+}
+
+/* Thread-exit destructor: the drainer frees the ring once it is empty */
+static void retire(void *r) {
+  __atomic_store_n(&((Ring)r)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static Ring myring() {
+  Ring r = (Ring)pthread_getspecific(lg.key);
+  if (r)
+    return r;
+  r = (Ring)calloc(1, sizeof(*r));
+  if (!r)
+    return 0;
+  pthread_mutex_lock(&lg.lock);
+  r->next = lg.rings;
+  lg.rings = r;
+  pthread_mutex_unlock(&lg.lock);
+  pthread_setspecific(lg.key, r);
+  return r;
+}
+
+/**
+ * Formats one message into the caller's ring, or writes it directly
+ * if the logger is not running, or if now is nonzero.
+ */
+static void vput(int fd, const char *file, int line, const char *kind,
+                 int now, const char *fmt, va_list ap) {
+  char local[LINE];
+  Ring r = !now && __atomic_load_n(&lg.on, __ATOMIC_ACQUIRE) ? myring() : 0;
+  Slot *s = 0;
+  char *text = local;
+  if (r) {
+    unsigned head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == SLOTS) {
+      __atomic_add_fetch(&lg.dropped, 1, __ATOMIC_RELAXED);
+      pthread_cond_signal(&lg.kick);
+      return;
+    }
+    s = &r->slot[head % SLOTS];
+    text = s->text;
+  }
+
+  int len = 0;
+  if (file)
+    len = snprintf(text, LINE, "%s:%d: %s: ", file, line, kind);
+  if (len < LINE - 1)
+    len += vsnprintf(text + len, LINE - 1 - len, fmt, ap);
+  if (len > LINE - 2)
+    len = LINE - 2;
+  text[len++] = '\n';
+
+  if (!s) {
+    writeall(fd, text, len);
+    return;
+  }
+  s->fd = fd;
+  s->len = len;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+  if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= SLOTS / 2)
+    pthread_cond_signal(&lg.kick);
+}
+
+extern void log_msg(int fd, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vput(fd, 0, 0, 0, 0, fmt, ap);
+  va_end(ap);
+}
+
+extern void log_loc(int fd, const char *file, int line, const char *kind,
+                    const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vput(fd, file, line, kind, 0, fmt, ap);
+  va_end(ap);
+}
+
+/**
+ * Writes one line synchronously, after everything queued so far, so it
+ * is neither dropped to a full ring nor lost to an exit that follows.
+ */
+extern void log_now(int fd, const char *file, int line, const char *kind,
+                    const char *fmt, ...) {
+  va_list ap;
+  log_flush();
+  va_start(ap, fmt);
+  vput(fd, file, line, kind, 1, fmt, ap);
+  va_end(ap);
+}
+
+/**
+ * Writes everything queued so far, synchronously, from the calling thread.
+ */
+extern void log_flush() {
+  if (!__atomic_load_n(&lg.on, __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock(&lg.lock);
+  drain();
+  pthread_mutex_unlock(&lg.lock);
+}
+
+/* Exit handler: write what is queued, and say what was lost */
+static void finish() {
+  pthread_mutex_lock(&lg.lock);
+  drain();
+  pthread_mutex_unlock(&lg.lock);
+  unsigned long dropped = __atomic_exchange_n(&lg.dropped, 0, __ATOMIC_RELAXED);
+  if (dropped)
+    fprintf(stderr, "log: %lu messages dropped\n", dropped);
+}
+
+/**
+ * Starts the drain thread; messages are queued from now on.
+ */
+extern void log_start() {
+  if (lg.on)
+    return;
+  if (!lg.keyed) {
+    if (pthread_key_create(&lg.key, retire)) {
+      fprintf(stderr, "log: pthread_key_create() failed\n");
+      return;
+    }
+    atexit(finish);
+    lg.keyed = 1;
+  }
+  lg.stop = 0;
+  if (pthread_create(&lg.drainer, 0, drainer, 0)) {
+    fprintf(stderr, "log: pthread_create() failed\n");
+    return;
+  }
+  __atomic_store_n(&lg.on, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Stops the drain thread after a final drain; later messages are written
+ * synchronously. Reports any messages dropped to full rings. The rings
+ * are kept, as a thread that saw the logger running may still be putting
+ * into its own; what it puts is drained at exit, or by a later log_start,
+ * which reuses them.
+ */
+extern void log_stop() {
+  if (!lg.on)
+    return;
+  __atomic_store_n(&lg.on, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&lg.lock);
+  lg.stop = 1;
+  pthread_cond_signal(&lg.kick);
+  pthread_mutex_unlock(&lg.lock);
+  pthread_join(lg.drainer, 0);
+
+  finish();
+}
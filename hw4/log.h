@@ -0,0 +1,36 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "linkage.h"
+
+// Asynchronous logging. Each thread formats messages into its own
+// single-producer ring; a background thread drains every ring with
+// batched writev(2). Before log_start(), and after log_stop(), messages
+// are written synchronously. A message that finds its ring full is dropped
+// and counted rather than blocking the caller; log_now never queues.
+
+// Severities, lowest first. Call sites below LOG_LEVEL compile away.
+#define LOG_DEBUG 0
+#define LOG_INFO  1
+#define LOG_WARN  2
+#define LOG_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+extern LINKAGE void log_start();
+extern LINKAGE void log_stop();
+extern LINKAGE void log_flush();
+
+// Queue one line for fd (1 or 2); loc variants prefix "file:line: kind: ".
+extern LINKAGE void log_msg(int fd, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+extern LINKAGE void log_loc(int fd, const char *file, int line, const char *kind,
+                            const char *fmt, ...)
+  __attribute__((format(printf, 5, 6)));
+extern LINKAGE void log_now(int fd, const char *file, int line, const char *kind,
+                            const char *fmt, ...)
+  __attribute__((format(printf, 5, 6)));
+
+#endif
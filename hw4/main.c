@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 
 #include "lawn.h"
 #include "mole.h"
@@ -10,97 +12,531 @@
 #include <pthread.h>
 #include "mtq.h"
 #include "threads.h"
+#include "rec.h"
+#include "replay.h"
+#include "config.h"
+#include "loadgen.h"
+#include "pipe.h"
+#include "metrics.h"
+#include "trace.h"
+#include "prof.h"
+#include "sweep.h"
+#include "tiers.h"
+#include "now.h"
+#include "vclock.h"
+#include "mem.h"
+#include "stop.h"
+#include "snap.h"
 
 // thread function sig
 typedef void *(*TFunction)(void *);
 
-// intialize mtq to null
-Mtq mtq = NULL;
+// state shared by every producer and consumer thread
+typedef struct
+{
+    Config *c;
+    Mtq mtq;
+    Lawn lawn;
+    long left;                // moles still to make, unless unlimited
+    uint64_t deadline;        // now_ns() when producers stop, if c->duration
+    int stopping;             // signalled: make no more moles
+    int discard;              // signalled: discard moles instead of whacking them
+    Pipe pipe;                // the pipeline, if the run is one
+} Run;
 
 /**
- * Creates a new mole and enqueues it to a mtq.
+ * Reports how many moles a producer should make next, up to n: those
+ * left to make, unless the run has reached its deadline.
+ *
+ * @param r the run.
+ * @param n the most to make.
  *
- * @param a A pointer to a void pointer array.
- *             a[0] is expected to be a pointer to a mtq object and a[1] is expected to be a pointer to a lawn object.
+ * @return the number to make, 0 if none.
+ */
+static int more(Run *r, int n)
+{
+    if (r->c->duration && now_ns() >= r->deadline)
+        return 0;
+    if (__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE))
+        return 0;
+    // with a duration but no mole count, make moles until the deadline
+    if (!r->c->moles && r->c->duration)
+        return n;
+    long left = __atomic_fetch_sub(&r->left, n, __ATOMIC_RELAXED);
+    return left <= 0 ? 0 : left < n ? left : n;
+}
+
+/**
+ * Removes an item that will not be whacked: a mole, or, in a batch run,
+ * a batch.
+ *
+ * @param r the run.
+ * @param d the item.
+ */
+static void discard(Run *r, Data d)
+{
+    if (r->c->batch)
+    {
+        mole_batch_discard(d);
+    }
+    else
+    {
+        mole_discard(d);
+    }
+}
+
+/**
+ * Creates new moles, or batches of them, and enqueues them to the mtq,
+ * until there are no more to make.
+ *
+ * @param a A pointer to the Run.
  *
  * @return null upon success
  */
 static void *produce(void *a)
 {
-    void **arg = a;
-    Mtq mtq = arg[0];
-    Lawn l = arg[1];
-    // add a new mole to the tail of mtq
-    mtq_tail_put(mtq, mole_new(l, 0, 0));
+    Run *r = a;
+    int n;
+    while ((n = more(r, r->c->batch ? r->c->batch : 1)))
+    {
+        // add a new item to the tail of mtq; if it was refused, it is still ours
+        Data d = r->c->batch ? mole_batch_new(r->lawn, n, r->c->vimlo, r->c->vimhi)
+                             : mole_new(r->lawn, r->c->vimlo, r->c->vimhi);
+        MtqStatus s = mtq_tail_put(r->mtq, d);
+        if (s == MtqFull || s == MtqTimedOut || s == MtqClosed)
+        {
+            discard(r, d);
+        }
+    }
     return 0;
 }
 
 /**
- * Consumes a mole by removing it from the mtq head and performing a whack.
+ * Consumes moles, or batches, by removing them from the mtq head and performing a whack,
+ * until the mtq is closed and empty, or, with a snapshot, until a stop.
+ * Once a stop says to discard, the rest are discarded instead, so the
+ * consumers drain the mtq in parallel.
  *
- * @param a A pointer to a void pointer array.
- *             a[0] is expected to be a pointer to a mtq
+ * @param a A pointer to the Run.
  *
  * @return NULL upon success
  */
 static void *consume(void *a)
-{    
-    void **arg = a;
-    Mtq mtq = arg[0];
-    // retrieve and remove a mole from the head of mtq
-    Mole whacked = (Mole)mtq_head_get(mtq);
-    // whack mole
-    mole_whack(whacked);
+{
+    Run *r = a;
+    Data whacked;
+    // retrieve and remove a mole from the head of mtq; after a stop, with a
+    // snapshot, the queued moles go to the next process, not to these consumers
+    while (!(*r->c->snapshot && __atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) &&
+           (whacked = mtq_head_get(r->mtq)))
+    {
+        if (__atomic_load_n(&r->discard, __ATOMIC_ACQUIRE))
+        {
+            discard(r, whacked);
+        }
+        else if (r->c->batch)
+        {
+            mole_batch_whack(whacked);
+        }
+        else
+        {
+            // whack mole
+            mole_whack(whacked);
+        }
+    }
     // success
     return 0;
 }
 
 /**
- * Frees the memory allocated to a mole object after it has been processed.
+ * Pipeline stages: one phase of the mole lifecycle each.
+ *
+ * @param d the mole (0 for generate).
+ * @param a A pointer to the Run.
+ *
+ * @return the mole, for the next stage.
+ */
+static Data generate(Data d, void *a)
+{
+    Run *r = a;
+    return mole_gen(r->lawn, r->c->vimlo, r->c->vimhi);
+}
+
+// once a stop says to discard, moles not yet hit are discarded, not passed on
+static Data create(Data d, void *a)
+{
+    Run *r = a;
+    if (__atomic_load_n(&r->discard, __ATOMIC_ACQUIRE))
+    {
+        mole_discard(d);
+        return 0;
+    }
+    mole_create(d);
+    return d;
+}
+
+static Data whack(Data d, void *a)
+{
+    Run *r = a;
+    if (__atomic_load_n(&r->discard, __ATOMIC_ACQUIRE))
+    {
+        mole_discard(d);
+        return 0;
+    }
+    mole_hit(d);
+    return d;
+}
+
+static Data expire(Data d, void *a)
+{
+    mole_expire(d);
+    return d;
+}
+
+static Data release(Data d, void *a)
+{
+    mole_free(d);
+    return 0;
+}
+
+/**
+ * Parses a comma-separated list of positive numbers.
+ *
+ * @param s the list.
+ * @param v where to store the numbers.
+ * @param n how many numbers the list must have.
+ * @param what the list's name, for errors.
+ */
+static void numbers(const char *s, int *v, int n, const char *what)
+{
+    for (int i = 0; i < n; i++)
+    {
+        char *end;
+        v[i] = strtol(s, &end, 10);
+        if (v[i] < 1 || end == s || (*end != ',' && *end) || (i < n - 1) != (*end == ','))
+        {
+            ERROR("%s: need %d positive numbers, comma-separated", what, n);
+        }
+        s = end + 1;
+    }
+}
+
+/**
+ * Stops a pipeline, on a signal: the generate stage makes no more moles,
+ * and those in flight run through the rest. Under the discard policy, or
+ * when the stop runs late, their delays are hurried, and those not yet
+ * hit are discarded.
+ *
+ * @param a A pointer to the Run.
+ * @param hard Nonzero if the stop is running late.
+ */
+static void pipe_stopped(void *a, int hard)
+{
+    Run *r = a;
+    __atomic_store_n(&r->stopping, 1, __ATOMIC_RELEASE);
+    pipe_stop(r->pipe);
+    if (hard || !strcmp(r->c->stop_policy, "discard"))
+    {
+        __atomic_store_n(&r->discard, 1, __ATOMIC_RELEASE);
+        lawn_hurry(r->lawn);
+    }
+}
+
+/**
+ * Runs the mole lifecycle as a pipeline: generate, create, whack, expire
+ * and free each run in their own threads, with a queue between each pair.
+ *
+ * @param r the run.
+ */
+static void pipeline(Run *r)
+{
+    static const char *names[] = {"generate", "create", "whack", "expire", "free"};
+    static const PipeF stages[] = {generate, create, whack, expire, release};
+    int threads[5], batch[5];
+    numbers(r->c->pipeline, threads, 5, "pipeline");
+    numbers(r->c->pipe_batch, batch, 5, "pipe_batch");
+    if (!r->c->moles && r->c->duration)
+    {
+        ERROR("the pipeline needs a mole count");
+    }
+
+    Pipe p = pipe_new(r->c->mtqmax);
+    for (int i = 0; i < 5; i++)
+    {
+        pipe_stage(p, names[i], stages[i], r, threads[i], batch[i]);
+    }
+    r->pipe = p;
+    stop_on(pipe_stopped, r, r->c->stop_budget);
+    pipe_run(p, r->left, r->c->report);
+    stop_on(0, 0, 0);
+    pipe_free(p);
+}
+
+/**
+ * Opens the lawn with the configured backend, in vim units that fit
+ * the configured vims.
+ *
+ * @param c the configuration.
+ *
+ * @return the lawn.
+ */
+static Lawn open_lawn(Config *c)
+{
+    LawnBackend b = lawn_backend(c->backend);
+    Lawn l = lawn_open(c->lawnsize, c->molesize, b, b == LawnShm ? c->shm : c->frames, c->frame_ms);
+    // with neither bound, moles live 1000..5000ms
+    lawn_vims(l, c->vimlo || c->vimhi ? c->vimhi : 5000);
+    return l;
+}
+
+/**
+ * Starts a simulation: the caller becomes its first thread, and every
+ * thread made from here on runs in virtual time. A simulation is one
+ * process with a text lawn, and is seeded, so that it can be repeated.
+ *
+ * @param c the configuration.
+ */
+static void simulate(Config *c)
+{
+    if (*c->replay || *c->sweep || *c->role || *c->snapshot)
+        ERROR("a simulation cannot replay, sweep, snapshot, or run as one of several processes");
+    if (strcmp(c->backend, "auto") && strcmp(c->backend, "text"))
+        ERROR("a simulation needs the text lawn, not %s", c->backend);
+    free(c->backend);
+    c->backend = strdup("text");
+    if (!c->seed)
+        c->seed = 1;
+    vclock_start();
+}
+
+/**
+ * Stops a run, on a signal: producers make no more moles, and the mtq is
+ * closed, which wakes every producer and consumer waiting on it. With a
+ * snapshot, consumers leave the queued moles for it, which main takes
+ * once they are done. Under
+ * the discard policy, or when the stop runs late, moles in flight are
+ * hurried through their delays, and the rest are discarded, not whacked.
+ *
+ * @param a A pointer to the Run.
+ * @param hard Nonzero if the stop is running late.
+ */
+static void stopped(void *a, int hard)
+{
+    Run *r = a;
+    __atomic_store_n(&r->stopping, 1, __ATOMIC_RELEASE);
+    if (hard || !strcmp(r->c->stop_policy, "discard"))
+    {
+        __atomic_store_n(&r->discard, 1, __ATOMIC_RELEASE);
+        lawn_hurry(r->lawn);
+    }
+    mtq_close(r->mtq);
+}
+
+/**
+ * Removes a mole that will not be whacked: one left in the mtq, or one
+ * evicted by its overflow policy.
  *
  * @param d data object for mole to be deleted.
  */
 static void free_mole(Data d)
 {
     Mole m = (Mole)d;
-    free(m);
+    if (m)
+    {
+        mole_discard(m);
+    }
 }
 
+/**
+ * Removes a batch that will not be whacked, as free_mole does a mole.
+ *
+ * @param d data object for batch to be deleted.
+ */
+static void free_batch(Data d)
+{
+    if (d)
+    {
+        mole_batch_discard(d);
+    }
+}
 
-int main()
+/**
+ * Reports what the mtq did, if its policy, or a stop, shed any moles, and how its
+ * capacity was adjusted, if it is adaptive.
+ *
+ * @param mtq the mtq.
+ */
+static void report(Mtq mtq)
 {
-    srandom(time(0));
+    MtqStats s;
+    mtq_stats(mtq, &s);
+    if (s.rejected || s.dropped_newest || s.dropped_oldest || s.timeouts || s.closed)
+    {
+        log_msg(2, "mtq: puts=%lu gets=%lu rejected=%lu dropped-newest=%lu dropped-oldest=%lu timeouts=%lu closed=%lu",
+                s.puts, s.gets, s.rejected, s.dropped_newest, s.dropped_oldest, s.timeouts, s.closed);
+    }
+    if (s.decisions)
+    {
+        log_msg(2, "mtq: capacity=%d decisions=%lu grown=%lu shrunk=%lu; last: sojourn=%.3fms standing=%.3fms put-wait=%.2f get-wait=%.2f",
+                s.capacity, s.decisions, s.grown, s.shrunk, s.sojourn_ms, s.standing_ms, s.put_wait, s.get_wait);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Config *c = config_load(argc, argv);
+    // signals that a thread of their own waits for are blocked before any
+    // thread is made, so every thread inherits them blocked
+    sigset_t waited;
+    sigemptyset(&waited);
+#ifdef TRACE
+    sigaddset(&waited, SIGUSR2);
+#endif
+    if (*c->snapshot)
+    {
+        sigaddset(&waited, SIGUSR1);
+    }
+    pthread_sigmask(SIG_BLOCK, &waited, 0);
+    // a batch is one mtq item; every other mode handles moles one by one
+    if (c->batch && (*c->replay || *c->sweep || *c->role || c->rate > 0 || *c->pipeline || *c->snapshot || *c->restore))
+    {
+        ERROR("batches are queued only in the closed loop, without a snapshot");
+    }
+    if (c->sim)
+    {
+        simulate(c);
+    }
+    // the seed used, kept for whatever seeds its own generators
+    if (!c->seed)
+    {
+        c->seed = time(0);
+    }
+    srandom(c->seed);
+    // a simulation logs synchronously, in the order its threads run, and
+    // stops only when it is done
+    if (!c->sim)
+    {
+        stop_signals();
+        log_start();
+    }
+    trace_start(c->trace);
+    prof_start();
+    if (*c->metrics)
+        met_serve(c->metrics);
 
-    // max capacity of mtq - capacity of four to cause produce congestion
-    const int mtqMax = 4;
+    if (*c->replay)
+    {
+        replay(c);
+        met_stop();
+        log_stop();
+        config_free(c);
+        return 0;
+    }
 
-    // num threads created
-    const int n = 15;
+    if (*c->record)
+        rec_open(c->record, c->record_max, c->lawnsize, c->molesize);
 
-    // create new mtq and lawn
-    mtq = mtq_new(mtqMax);
-    Lawn lawn = lawn_new(0, 0);
+    if (strcmp(c->engine, "mutex"))
+        ERROR("unknown queue engine: %s", c->engine);
+
+    // a sweep measures the bare queue, with no lawn
+    if (*c->sweep)
+    {
+        sweep(c);
+        rec_close();
+        met_stop();
+        log_stop();
+        config_free(c);
+        return 0;
+    }
 
-    // allocate args for mtq and lawn pointers
-    void **threadArgs = malloc(sizeof(void *) * 2);
-    if (!threadArgs)
+    // as one of several processes, joined by a shared mtq
+    if (*c->role)
+    {
+        Lawn lawn = strcmp(c->role, "producer") ? open_lawn(c) : 0;
+        tiers(c, lawn);
+        if (lawn)
+            lawn_free(lawn);
+        rec_close();
+        met_stop();
+        log_stop();
+        config_free(c);
+        return 0;
+    }
+
+    // with an arrival rate, run open-loop instead
+    if (c->rate > 0)
+    {
+        Lawn lawn = open_lawn(c);
+        loadgen(c, lawn);
+        mem_report();
+        lawn_free(lawn);
+        rec_close();
+        met_stop();
+        log_stop();
+        config_free(c);
+        return 0;
+    }
+
+    DeqMapF freer = c->batch ? &free_batch : &free_mole;
+
+    // create new mtq and lawn
+    Mtq mtq = mtq_new_policy(c->mtqmax, mtq_policy(c->policy), freer, c->put_timeout);
+    if (c->adapt_max)
     {
-        ERROR("Failed malloc for threadArgs");
+        mtq_adapt(mtq, c->adapt_min, c->adapt_max, c->adapt_target, c->adapt_interval);
     }
+    Run r = {c, mtq, open_lawn(c)};
 
-    threadArgs[0] = mtq;
-    threadArgs[1] = lawn;
+    r.left = c->moles ? c->moles : c->producers * (c->batch ? c->batch : 1);
+    r.deadline = now_ns() + c->duration * 1000000ULL;
 
-    // consume/produce n threads
-    pthread_t **produceThreads = create_threads(produce, n, threadArgs);
-    pthread_t **consumeThreads = create_threads(consume, n, threadArgs);
+    // with per-stage thread counts, run the lifecycle as a pipeline instead
+    if (*c->pipeline)
+    {
+        pipeline(&r);
+        mem_report();
+        lawn_free(r.lawn);
+        mtq_del(r.mtq, freer);
+        rec_close();
+        met_stop();
+        log_stop();
+        config_free(c);
+        return 0;
+    }
 
-    // wait for all threads to finish
-    wait_threads(produceThreads, n);
-    wait_threads(consumeThreads, n);
+    // consume/produce with the configured number of threads
+    // moles queued by an earlier process go first
+    if (*c->restore)
+    {
+        snap_restore(c->restore, r.mtq, r.lawn);
+    }
+    if (*c->snapshot)
+    {
+        snap_start(c->snapshot, c->snapshot_ms, r.mtq, r.lawn);
+    }
+    stop_on(stopped, &r, c->stop_budget);
+    pthread_t **produceThreads = create_threads(produce, c->producers, &r);
+    pthread_t **consumeThreads = create_threads(consume, c->consumers, &r);
+
+    // wait for all producers, then close the mtq, so consumers finish once it is empty
+    wait_threads(produceThreads, c->producers);
+    mtq_close(r.mtq);
+    wait_threads(consumeThreads, c->consumers);
+    snap_stop();
+    stop_on(0, 0, 0);
+    report(r.mtq);
+    mem_report();
 
     // cleanup
-    lawn_free(lawn);
-    free(threadArgs);
-    mtq_del(mtq, &free_mole);
+    lawn_free(r.lawn);
+    mtq_del(r.mtq, freer);
+    rec_close();
+    if (stop_requested())
+    {
+        log_msg(2, "stop: exited in %.1fms", stop_ms());
+    }
+    met_stop();
+    log_stop();
+    config_free(c);
 }
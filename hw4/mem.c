@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "mem.h"
+#include "log.h"
+#include "error.h"
+
+#define SLABS 8        // slabs, process-wide
+#define CHUNK (1<<20)  // bytes a slab takes from the system at once
+#define CACHE 64       // objects a thread keeps per slab
+#define BATCH 16384    // bytes a thread accounts on its own before adding them to the totals
+
+static const char *names[MemKinds] = {"moles", "deq", "queue", "lawn", "widgets"};
+
+static struct {
+  long bytes[MemKinds];
+  long peak[MemKinds];
+} mem;
+
+static __thread long pending[MemKinds]; // the calling thread's, not yet in mem
+static __thread int registered;         // for spill()
+static void enroll();
+
+/* Adds bytes to a subsystem's total, and raises its peak to match */
+static void settle(MemKind k, long bytes) {
+  long now = __atomic_add_fetch(&mem.bytes[k], bytes, __ATOMIC_RELAXED);
+  long peak = __atomic_load_n(&mem.peak[k], __ATOMIC_RELAXED);
+  while (now > peak &&
+         !__atomic_compare_exchange_n(&mem.peak[k], &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Adds the calling thread's pending bytes to the totals */
+static void flush() {
+  for (int k = 0; k < MemKinds; k++)
+    if (pending[k]) {
+      settle(k, pending[k]);
+      pending[k] = 0;
+    }
+}
+
+/**
+ * Accounts for bytes allocated (or, negative, freed) by a subsystem. A
+ * thread keeps its own count, and adds it to the totals once it passes
+ * BATCH either way, or when the thread exits, so that the hot paths of
+ * different threads and queues share no cache line.
+ */
+extern void mem_add(MemKind k, long bytes) {
+  long p = pending[k] += bytes;
+  if (p > -BATCH && p < BATCH) {
+    if (!registered)
+      enroll();
+    return;
+  }
+  pending[k] = 0;
+  settle(k, p);
+}
+
+extern long mem_bytes(MemKind k) {
+  return __atomic_load_n(&mem.bytes[k], __ATOMIC_RELAXED);
+}
+
+extern long mem_peak(MemKind k) {
+  return __atomic_load_n(&mem.peak[k], __ATOMIC_RELAXED);
+}
+
+/* Logs each subsystem's current and peak bytes */
+extern void mem_report() {
+  long now = 0, peak = 0;
+  flush();
+  for (int k = 0; k < MemKinds; k++) {
+    now += mem_bytes(k);
+    peak += mem_peak(k);
+    log_msg(2, "mem: %-8s %12ld bytes, peak %12ld", names[k], mem_bytes(k), mem_peak(k));
+  }
+  log_msg(2, "mem: %-8s %12ld bytes, peak %12ld (peaks summed)", "total", now, peak);
+}
+
+// A free object
+typedef struct Obj {
+  struct Obj *next;
+} Obj;
+
+// One thread's cache for one slab
+typedef struct {
+  Obj *head;
+  int n;
+} Cache;
+
+typedef struct {
+  int id;
+  size_t size;
+  MemKind kind;
+  pthread_mutex_t lock; // guards the rest
+  Obj *free;
+  char *chunk;          // the unused end of the latest chunk
+  size_t left;          // bytes there
+} *Rep;
+
+static Rep slabs[SLABS];
+static int nslabs;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread Cache caches[SLABS];
+
+/* Thread-exit destructor: return the thread's cached objects, and account its bytes */
+static void spill(void *a) {
+  flush();
+  for (int i = 0; i < nslabs; i++) {
+    Rep r = slabs[i];
+    Cache *c = &caches[i];
+    if (!c->head)
+      continue;
+    Obj *tail = c->head;
+    while (tail->next)
+      tail = tail->next;
+    pthread_mutex_lock(&r->lock);
+    tail->next = r->free;
+    r->free = c->head;
+    pthread_mutex_unlock(&r->lock);
+    c->head = 0;
+    c->n = 0;
+  }
+}
+
+static void init() {
+  if (pthread_key_create(&key, spill)) ERROR("pthread_key_create() failed");
+}
+
+/**
+ * Creates a slab.
+ *
+ * @param size bytes per object; rounded up to hold a pointer, aligned.
+ * @param k the subsystem its chunks are accounted to.
+ */
+extern Slab slab_new(size_t size, MemKind k) {
+  pthread_once(&once, init);
+  Rep r = (Rep)calloc(1, sizeof(*r));
+  if (!r) ERROR("calloc() failed");
+  size = size < sizeof(Obj) ? sizeof(Obj) : size;
+  r->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  r->kind = k;
+  pthread_mutex_init(&r->lock, 0);
+  int id = __atomic_fetch_add(&nslabs, 1, __ATOMIC_RELAXED);
+  if (id >= SLABS) ERROR("too many slabs");
+  r->id = id;
+  slabs[id] = r;
+  return r;
+}
+
+/* Arranges for spill() at the calling thread's exit */
+static void enroll() {
+  pthread_once(&once, init);
+  registered = 1;
+  pthread_setspecific(key, caches); // any non-0 value will do
+}
+
+/* Fills a thread's cache with up to CACHE/2 objects, carving a chunk if need be */
+static void refill(Rep r, Cache *c) {
+  if (!registered)
+    enroll();
+  pthread_mutex_lock(&r->lock);
+  while (c->n < CACHE / 2) {
+    Obj *o = r->free;
+    if (o)
+      r->free = o->next;
+    else {
+      if (r->left < r->size) {
+        r->chunk = (char *)malloc(CHUNK);
+        if (!r->chunk) ERROR("malloc() failed");
+        r->left = CHUNK;
+        settle(r->kind, CHUNK);
+      }
+      o = (Obj *)r->chunk;
+      r->chunk += r->size;
+      r->left -= r->size;
+    }
+    o->next = c->head;
+    c->head = o;
+    c->n++;
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+extern void *slab_alloc(Slab s) {
+  Rep r = (Rep)s;
+  Cache *c = &caches[r->id];
+  if (!c->head)
+    refill(r, c);
+  Obj *o = c->head;
+  c->head = o->next;
+  c->n--;
+  return o;
+}
+
+extern void slab_free(Slab s, void *p) {
+  Rep r = (Rep)s;
+  Cache *c = &caches[r->id];
+  Obj *o = (Obj *)p;
+  if (!registered)
+    enroll();
+  o->next = c->head;
+  c->head = o;
+  if (++c->n < CACHE)
+    return;
+  // keep half; return the rest to the slab in one go
+  Obj *keep = c->head;
+  for (int i = 1; i < CACHE / 2; i++)
+    keep = keep->next;
+  Obj *rest = keep->next, *tail = rest;
+  while (tail->next)
+    tail = tail->next;
+  keep->next = 0;
+  c->n = CACHE / 2;
+  pthread_mutex_lock(&r->lock);
+  tail->next = r->free;
+  r->free = rest;
+  pthread_mutex_unlock(&r->lock);
+}
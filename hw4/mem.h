@@ -0,0 +1,41 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+#include "linkage.h"
+
+// Memory accounting, by subsystem, for sizing a host for a target number
+// of live moles: each subsystem reports the bytes it allocates and frees,
+// and mem_report() gives the current and peak bytes of each. Counts are
+// of requested sizes, not of allocator overhead; a slab's are of its
+// whole chunks, which is what it takes from the system. Each thread adds
+// its counts to the totals in batches, so while it runs they may be off
+// by up to 16 KB per thread and subsystem; a thread's exit, and
+// mem_report() for its caller, settle its counts.
+
+typedef enum {
+  MemMoles,   // MoleReps and batches
+  MemDeq,     // deq headers and nodes
+  MemQueue,   // mtq headers
+  MemLawn,    // lawns and their spatial indexes
+  MemWidgets, // FLTK boxes, and raster and publish buffers
+  MemKinds
+} MemKind;
+
+extern LINKAGE void mem_add(MemKind k, long bytes); // negative to free
+extern LINKAGE long mem_bytes(MemKind k);
+extern LINKAGE long mem_peak(MemKind k);
+extern LINKAGE void mem_report();                   // to stderr, by log_msg
+
+// A slab: fixed-size objects carved from large chunks, with a small
+// cache per thread, so an object costs no malloc header and a thread
+// rarely takes the slab's lock. Objects freed by another thread than
+// the one that allocated them are fine. Chunks are never returned.
+typedef void *Slab;
+
+extern LINKAGE Slab  slab_new(size_t size, MemKind k);
+extern LINKAGE void *slab_alloc(Slab s);
+extern LINKAGE void  slab_free(Slab s, void *p);
+
+#endif
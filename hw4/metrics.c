@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "metrics.h"
+#include "error.h"
+
+#define METRICS 64   // registered metrics, at most
+#define BUCKETS 40   // log2 ns buckets: 1 ns .. ~9 min
+#define SLOTS   1024 // counters per shard
+
+// A registered metric, and where its values live in each shard
+typedef struct {
+  MetKind kind;
+  char *name;
+  char *help;
+  int slot; // a counter or gauge is one slot; a histogram is count, sum, buckets
+} Def;
+
+// One thread's values
+typedef struct Shard {
+  struct Shard *next;
+  uint64_t v[SLOTS];
+} *Shard;
+
+// Registry: one per process
+static struct {
+  pthread_mutex_t lock; // guards registration and the shard list, never updates
+  pthread_key_t key;
+  pthread_once_t once;
+  int n;                // defs in use; defs[0] is unused
+  int slots;
+  Def defs[METRICS + 1];
+  Shard shards;
+  uint64_t retired[SLOTS]; // values of exited threads
+  int fd;
+  char *path;
+  pthread_t server;
+} reg = {.lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT, .n = 1, .fd = -1};
+
+/* Thread-exit destructor: fold the shard into the retired totals */
+static void retire(void *v) {
+  Shard s = (Shard)v;
+  pthread_mutex_lock(&reg.lock);
+  for (Shard *p = &reg.shards; *p; p = &(*p)->next)
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  for (int i = 0; i < SLOTS; i++)
+    reg.retired[i] += s->v[i];
+  pthread_mutex_unlock(&reg.lock);
+  free(s);
+}
+
+static void init() {
+  if (pthread_key_create(&reg.key, retire))
+    ERROR("pthread_key_create() failed");
+}
+
+static Shard myshard() {
+  Shard s = (Shard)pthread_getspecific(reg.key);
+  if (s)
+    return s;
+  s = (Shard)calloc(1, sizeof(*s));
+  if (!s) ERROR("calloc() failed");
+  pthread_mutex_lock(&reg.lock);
+  s->next = reg.shards;
+  reg.shards = s;
+  pthread_mutex_unlock(&reg.lock);
+  pthread_setspecific(reg.key, s);
+  return s;
+}
+
+/**
+ * Registers a metric, or finds the one already registered by that name.
+ *
+ * @param kind counter, gauge, or histogram.
+ * @param name Prometheus metric name.
+ * @param help Prometheus help text.
+ *
+ * @return the metric's id.
+ */
+extern Metric met_register(MetKind kind, const char *name, const char *help) {
+  pthread_once(&reg.once, init);
+  pthread_mutex_lock(&reg.lock);
+  for (int i = 1; i < reg.n; i++)
+    if (!strcmp(reg.defs[i].name, name)) {
+      pthread_mutex_unlock(&reg.lock);
+      return i;
+    }
+  int width = kind == MetHist ? 2 + BUCKETS : 1;
+  if (reg.n > METRICS || reg.slots + width > SLOTS)
+    ERROR("too many metrics: %s", name);
+  Def *d = &reg.defs[reg.n];
+  d->kind = kind;
+  d->name = strdup(name);
+  d->help = strdup(help);
+  d->slot = reg.slots;
+  reg.slots += width;
+  Metric m = reg.n;
+  __atomic_store_n(&reg.n, reg.n + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&reg.lock);
+  return m;
+}
+
+/* Adds n (which may be negative, for a gauge) to a counter or gauge */
+extern void met_add(Metric m, int64_t n) {
+  Shard s = myshard();
+  __atomic_add_fetch(&s->v[reg.defs[m].slot], (uint64_t)n, __ATOMIC_RELAXED);
+}
+
+/* Records one value, in ns, in a histogram */
+extern void met_observe(Metric m, uint64_t ns) {
+  Shard s = myshard();
+  uint64_t *v = &s->v[reg.defs[m].slot];
+  int b = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (b >= BUCKETS)
+    b = BUCKETS - 1;
+  __atomic_add_fetch(&v[0], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&v[1], ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&v[2 + b], 1, __ATOMIC_RELAXED);
+}
+
+/* Sums a slot over every shard and the retired totals; caller holds reg.lock */
+static uint64_t sum(int slot) {
+  uint64_t t = reg.retired[slot];
+  for (Shard s = reg.shards; s; s = s->next)
+    t += __atomic_load_n(&s->v[slot], __ATOMIC_RELAXED);
+  return t;
+}
+
+/**
+ * Writes every metric to fd in Prometheus text exposition format.
+ * Takes only the registry lock, never a queue or display lock, and only
+ * to sum the shards: a slow reader of fd holds up no other thread.
+ */
+extern void met_write(int fd) {
+  uint64_t v[SLOTS];
+  pthread_mutex_lock(&reg.lock);
+  int n = reg.n;
+  for (int i = 0; i < reg.slots; i++)
+    v[i] = sum(i);
+  pthread_mutex_unlock(&reg.lock);
+
+  // a def, once registered, never changes
+  FILE *f = fdopen(dup(fd), "w");
+  if (!f)
+    return;
+  for (int i = 1; i < n; i++) {
+    Def *d = &reg.defs[i];
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, types[d->kind]);
+    if (d->kind != MetHist) {
+      fprintf(f, "%s %lld\n", d->name,
+              d->kind == MetGauge ? (long long)(int64_t)v[d->slot] : (long long)v[d->slot]);
+      continue;
+    }
+    // bucket b holds values below 2^b ns; Prometheus wants cumulative seconds
+    uint64_t cum = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+      uint64_t k = v[d->slot + 2 + b];
+      cum += k;
+      if (k)
+        fprintf(f, "%s_bucket{le=\"%.9g\"} %llu\n", d->name, (double)(1ULL << b) / 1e9,
+                (unsigned long long)cum);
+    }
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", d->name, (unsigned long long)cum);
+    fprintf(f, "%s_sum %.9f\n", d->name, v[d->slot + 1] / 1e9);
+    fprintf(f, "%s_count %llu\n", d->name, (unsigned long long)v[d->slot]);
+  }
+  fclose(f);
+}
+
+/**
+ * Server thread: answers each connection with one scrape. A request
+ * starting "GET" gets an HTTP response, so curl --unix-socket works;
+ * anything else gets the bare text.
+ */
+static void *serve(void *a) {
+  struct sched_param p = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &p);
+  setpriority(PRIO_PROCESS, 0, 19);
+  for (;;) {
+    int c = accept(reg.fd, 0, 0);
+    if (c < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    // a client that neither sends nor reads is given up on
+    char req[512];
+    struct timeval tv = {0, 100000};
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    ssize_t n = recv(c, req, sizeof(req), 0);
+    if (n >= 3 && !strncmp(req, "GET", 3)) {
+      static const char hdr[] = "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+      if (write(c, hdr, sizeof(hdr) - 1) < 0) {
+        close(c);
+        continue;
+      }
+    }
+    met_write(c);
+    close(c);
+  }
+  return 0;
+}
+
+/**
+ * Starts serving the registry on a Unix domain socket.
+ *
+ * @param path the socket's path; an existing socket there is replaced.
+ */
+extern void met_serve(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    ERROR("socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+  reg.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (reg.fd < 0) ERROR("socket() failed: %s", strerror(errno));
+  unlink(path);
+  if (bind(reg.fd, (struct sockaddr *)&addr, sizeof(addr)))
+    ERROR("bind(%s) failed: %s", path, strerror(errno));
+  if (listen(reg.fd, 16))
+    ERROR("listen() failed: %s", strerror(errno));
+  reg.path = strdup(path);
+  if (pthread_create(&reg.server, 0, serve, 0))
+    ERROR("pthread_create() failed");
+}
+
+/* Stops the server, if running, and removes its socket */
+extern void met_stop() {
+  if (reg.fd < 0)
+    return;
+  shutdown(reg.fd, SHUT_RDWR);
+  pthread_join(reg.server, 0);
+  close(reg.fd);
+  reg.fd = -1;
+  unlink(reg.path);
+  free(reg.path);
+}
@@ -0,0 +1,41 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+
+// An in-process metrics registry. Every thread updates its own shard of
+// counters with relaxed atomics, so updates never contend or lock; a
+// scrape sums the shards. Gauges are summed deltas, so any thread may
+// raise or lower one. Histograms count values (ns) in log2 buckets.
+// met_serve() answers each connection to a Unix socket with the registry
+// in Prometheus text format, from a SCHED_IDLE thread.
+
+typedef enum {MetCounter, MetGauge, MetHist} MetKind;
+
+typedef int Metric; // 0 until registered
+
+extern LINKAGE Metric met_register(MetKind kind, const char *name, const char *help);
+extern LINKAGE void   met_add(Metric m, int64_t n);       // counter or gauge
+extern LINKAGE void   met_observe(Metric m, uint64_t ns); // histogram
+extern LINKAGE void   met_write(int fd);
+extern LINKAGE void   met_serve(const char *path);
+extern LINKAGE void   met_stop();
+
+// Registers a metric on first use, caching its id in a static variable.
+// Registration is idempotent by name, so a race to register is harmless.
+#define MET(kind,name,help) ({                      \
+  static Metric _m;                                 \
+  if (!_m) _m = met_register(kind, name, help);     \
+  _m; })
+
+// COUNT(name,help,n), GAUGE(name,help,n) and OBSERVE(name,help,ns); the
+// indirection lets name and help come from one macro.
+#define COUNT(...)   MET_ADD(MetCounter,__VA_ARGS__)
+#define GAUGE(...)   MET_ADD(MetGauge,__VA_ARGS__)
+#define OBSERVE(...) MET_OBSERVE(__VA_ARGS__)
+#define MET_ADD(kind,name,help,n)    met_add(MET(kind,name,help),(n))
+#define MET_OBSERVE(name,help,ns)    met_observe(MET(MetHist,name,help),(ns))
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "mole.h"
@@ -7,32 +8,247 @@
 #include "lawnimp.h"
 #undef LAWNIMP
 #include "error.h"
+#include "metrics.h"
+#include "prof.h"
+#include "mem.h"
+
+#define LIVE "wam_moles_live","moles allocated and not yet freed"
+#define CREATED "wam_moles_created_total","moles shown on the lawn"
+#define WHACKED "wam_moles_whacked_total","moles hit"
+
+static int ids;
+static Slab slab;
+static pthread_once_t once=PTHREAD_ONCE_INIT;
+
+static void init() { slab=slab_new(sizeof(*(MoleRep)0),MemMoles); }
 
 static int rdm(int lo, int hi) {
   return random()%(hi-lo+1)+lo;
 }
 
-extern Mole mole_new(Lawn l, int vimlo, int vimhi) {
-  if (!vimlo) vimlo=1;
-  if (!vimhi) vimhi=5;
+// A vim in ms, to the lawn's units, rounded, and cut to a byte
+static uint8_t vim(LawnRep l, int ms) {
+  int v=(ms+l->quantum/2)/l->quantum;
+  return v>255 ? 255 : v;
+}
+
+static MoleRep alloc(LawnRep lawn, int x, int y, int vim0, int vim1, int vim2) {
+  pthread_once(&once,init);
+  MoleRep mole=(MoleRep)slab_alloc(slab);
+  mole->id=__atomic_fetch_add(&ids,1,__ATOMIC_RELAXED);
+  mole->x=x;
+  mole->y=y;
+  mole->vim0=vim(lawn,vim0);
+  mole->vim1=vim(lawn,vim1);
+  mole->vim2=vim(lawn,vim2);
+  mole->lawn=lawn->handle;
+  mole->box=0;
+  // a slab object holds a freed mole's bytes: placed, it must be whole
+  lawn_place(lawn,&x,&y,mole);
+  mole->x=x;
+  mole->y=y;
+  GAUGE(LIVE,1);
+  return mole;
+}
+
+extern Mole mole_gen(Lawn l, int vimlo, int vimhi) {
+  PROF_SCOPE("mole_gen");
+  if (!vimlo && !vimhi) { vimlo=1000; vimhi=5000; }
 
   LawnRep lawn=(LawnRep)l;
-  MoleRep mole=(MoleRep)malloc(sizeof(*mole));
-  if (!mole) ERROR("malloc() failed");
-  mole->size=lawn->molesize;
   int max=lawn->lawnsize*lawn->molesize;
-  mole->x=rdm(0,max-1);
-  mole->y=rdm(0,max-1);
-  mole->vim0=rdm(vimlo,vimhi);
-  mole->vim1=rdm(vimlo,vimhi);
-  mole->vim2=rdm(vimlo,vimhi);
-  mole->lawn=lawn;
+  int x=rdm(0,max-1);
+  int y=rdm(0,max-1);
+  int vim0=rdm(vimlo,vimhi);
+  int vim1=rdm(vimlo,vimhi);
+  int vim2=rdm(vimlo,vimhi);
+  return alloc(lawn,x,y,vim0,vim1,vim2);
+}
+
+extern void mole_create(Mole m) {
+  MoleRep mole=(MoleRep)m;
   mole->box=lawnimp_mole(mole);
+  COUNT(CREATED,1);
+}
+
+extern Mole mole_new(Lawn l, int vimlo, int vimhi) {
+  PROF_SCOPE("mole_new");
+  Mole m=mole_gen(l,vimlo,vimhi);
+  mole_create(m);
+  return m;
+}
+
+// A mole with given position and vims, as for a replay
+extern Mole mole_at(Lawn l, int x, int y, int vim0, int vim1, int vim2) {
+  MoleRep mole=alloc((LawnRep)l,x,y,vim0,vim1,vim2);
+  mole_create(mole);
   return mole;
 }
 
+extern int mole_size() {
+  return sizeof(*(MoleRep)0);
+}
+
+extern void mole_save(Mole m, void *to) {
+  MoleRep from=(MoleRep)m, mole=(MoleRep)to;
+  memset(mole,0,sizeof(*mole)); // padding too, so snapshots are reproducible
+  mole->id=from->id;
+  mole->x=from->x;
+  mole->y=from->y;
+  mole->vim0=from->vim0;
+  mole->vim1=from->vim1;
+  mole->vim2=from->vim2;
+}
+
+extern Mole mole_load(Lawn l, void *at, int quantum) {
+  pthread_once(&once,init);
+  LawnRep lawn=(LawnRep)l;
+  MoleRep mole=(MoleRep)at;
+  if (quantum!=lawn->quantum) {
+    mole->vim0=vim(lawn,mole->vim0*quantum);
+    mole->vim1=vim(lawn,mole->vim1*quantum);
+    mole->vim2=vim(lawn,mole->vim2*quantum);
+  }
+  mole->lawn=lawn->handle;
+  mole->box=0;
+  int x=mole->x, y=mole->y;
+  lawn_place(lawn,&x,&y,mole);
+  mole->x=x;
+  mole->y=y;
+  // later moles get later ids
+  int next=mole->id+1, old=__atomic_load_n(&ids,__ATOMIC_RELAXED);
+  while (old<next && !__atomic_compare_exchange_n(&ids,&old,next,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+    ;
+  GAUGE(LIVE,1);
+  mole->box=lawnimp_show(mole);
+  COUNT("wam_moles_restored_total","moles restored from a snapshot, without their create delay",1);
+  return mole;
+}
+
+extern void mole_hit(Mole m) {
+  lawnimp_hit(m);
+  COUNT(WHACKED,1);
+}
+
+extern void mole_expire(Mole m) {
+  lawnimp_expire(m);
+}
+
+extern void mole_free(Mole m) {
+  MoleRep mole=(MoleRep)m;
+  lawn_leave(MOLE_LAWN(mole),mole->x,mole->y,mole);
+  slab_free(slab,m);
+  GAUGE(LIVE,-1);
+}
+
 extern void mole_whack(Mole m) {
-  lawnimp_whack(m);
-  free(m);
+  mole_hit(m);
+  mole_expire(m);
+  mole_free(m);
+}
+
+extern void mole_discard(Mole m) {
+  lawnimp_discard(m);
+  COUNT("wam_moles_discarded_total","moles removed without a whack",1);
+  mole_free(m);
+}
+
+// Scale raw random() values (31 bits) into [lo,hi] with a multiply and
+// shift, rather than %, so the loop has no division and vectorizes.
+static void scale(int *restrict v, int n, int lo, int hi) {
+  unsigned long long range=hi-lo+1;
+  for (int i=0; i<n; i++)
+    v[i]=(int)(((unsigned long long)v[i]*range)>>31)+lo;
+}
+
+static void fill(int *restrict v, int n) {
+  for (int i=0; i<n; i++)
+    v[i]=random();
+}
+
+#define CHUNK 64       // moles drawn at a time, in ints, before packing
+
+static size_t batch_bytes(int n) {
+  return sizeof(*(MoleBatchRep)0)+n*(sizeof(void*)+2*sizeof(uint16_t)+3*sizeof(uint8_t));
+}
+
+extern MoleBatch mole_batch_new(Lawn l, int n, int vimlo, int vimhi) {
+  PROF_SCOPE("mole_batch_new");
+  if (!vimlo && !vimhi) { vimlo=1000; vimhi=5000; }
+  if (n<=0) ERROR("bad batch size: %d",n);
+
+  LawnRep lawn=(LawnRep)l;
+  size_t bytes=batch_bytes(n);
+  MoleBatchRep b=(MoleBatchRep)malloc(bytes);
+  if (!b) ERROR("malloc() failed");
+  mem_add(MemMoles,bytes);
+  b->n=n;
+  b->id=__atomic_fetch_add(&ids,n,__ATOMIC_RELAXED);
+  b->lawn=lawn->handle;
+  b->box=(void **)(b+1);
+  b->x=(uint16_t *)(b->box+n);
+  b->y=b->x+n;
+  b->vim0=(uint8_t *)(b->y+n);
+  b->vim1=b->vim0+n;
+  b->vim2=b->vim1+n;
+
+  // draw each field a chunk at a time, then pack it as a MoleRep would
+  int max=lawn->lawnsize*lawn->molesize;
+  int v[5][CHUNK];
+  for (int i=0; i<n; i+=CHUNK) {
+    int k=n-i<CHUNK ? n-i : CHUNK;
+    for (int f=0; f<5; f++)
+      fill(v[f],k);
+    scale(v[0],k,0,max-1);
+    scale(v[1],k,0,max-1);
+    for (int f=2; f<5; f++)
+      scale(v[f],k,vimlo,vimhi);
+    for (int j=0; j<k; j++) {
+      b->x[i+j]=v[0][j];
+      b->y[i+j]=v[1][j];
+      b->vim0[i+j]=vim(lawn,v[2][j]);
+      b->vim1[i+j]=vim(lawn,v[3][j]);
+      b->vim2[i+j]=vim(lawn,v[4][j]);
+    }
+  }
+  // the batch itself is the occupant of each of its cells
+  for (int i=0; i<n; i++) {
+    int x=b->x[i], y=b->y[i];
+    lawn_place(lawn,&x,&y,b);
+    b->x[i]=x;
+    b->y[i]=y;
+    b->box[i]=0;
+  }
+
+  GAUGE(LIVE,n);
+  lawnimp_batch(b);
+  COUNT(CREATED,n);
+  return b;
 }
 
+extern int mole_batch_len(MoleBatch b) {
+  return ((MoleBatchRep)b)->n;
+}
+
+static void batch_free(MoleBatchRep b) {
+  LawnRep lawn=lawn_rep(b->lawn);
+  for (int i=0; i<b->n; i++)
+    lawn_leave(lawn,b->x[i],b->y[i],b);
+  GAUGE(LIVE,-b->n);
+  mem_add(MemMoles,-(long)batch_bytes(b->n));
+  free(b);
+}
+
+extern void mole_batch_whack(MoleBatch b) {
+  MoleBatchRep r=(MoleBatchRep)b;
+  lawnimp_batch_whack(r);
+  COUNT(WHACKED,r->n);
+  batch_free(r);
+}
+
+extern void mole_batch_discard(MoleBatch b) {
+  MoleBatchRep r=(MoleBatchRep)b;
+  lawnimp_batch_discard(r);
+  COUNT("wam_moles_discarded_total","moles removed without a whack",r->n);
+  batch_free(r);
+}
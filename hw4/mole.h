@@ -5,7 +5,35 @@
 
 typedef void *Mole;
 
+// vims are milliseconds: 0 for both selects 1000..5000
 extern Mole mole_new(Lawn l, int vimlo, int vimhi);
+extern Mole mole_at(Lawn l, int x, int y, int vim0, int vim1, int vim2);
 extern void mole_whack(Mole m);
+extern void mole_discard(Mole m); // remove and free, unwhacked
+
+// The lifecycle one phase at a time, for running phases in separate
+// threads: mole_new is gen then create; mole_whack is hit, expire, free.
+extern Mole mole_gen(Lawn l, int vimlo, int vimhi);
+extern void mole_create(Mole m);
+extern void mole_hit(Mole m);
+extern void mole_expire(Mole m);
+extern void mole_free(Mole m);
+
+// A mole's bytes, for a snapshot: its fields as they are, less its box
+// and lawn. mole_load adopts saved bytes in place, as a mole of a lawn,
+// and shows it at once; once freed, its bytes are reused for new moles.
+extern int  mole_size();
+extern void mole_save(Mole m, void *to);
+extern Mole mole_load(Lawn l, void *at, int quantum); // quantum: the saved vims' unit
+
+// A batch of n moles in struct-of-arrays storage.
+// It is created, queued, and whacked as a single Data item, sharing one
+// delay per phase: the longest of its moles'.
+typedef void *MoleBatch;
+
+extern MoleBatch mole_batch_new(Lawn l, int n, int vimlo, int vimhi);
+extern int       mole_batch_len(MoleBatch b);
+extern void      mole_batch_whack(MoleBatch b);
+extern void      mole_batch_discard(MoleBatch b); // remove and free, unwhacked
 
 #endif
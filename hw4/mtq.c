@@ -1,9 +1,40 @@
 #include "error.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "mtq.h"
 #include "pthread.h"
+#include "metrics.h"
+#include "now.h"
+#include "trace.h"
+#include "vclock.h"
+#include "prof.h"
+#include "mem.h"
+
+// metrics shared by several functions
+#define PRODUCERS "wam_mtq_waiting_producers", "threads waiting for room in an mtq"
+#define CONSUMERS "wam_mtq_waiting_consumers", "threads waiting for data in an mtq"
+#define DEPTH     "wam_mtq_depth", "items in all mtqs"
+
+// An adaptive mtq's controller: what it measures over each interval
+typedef struct
+{
+    int lo, hi;          // bounds on the capacity
+    uint64_t target;     // ns of standing sojourn tolerated
+    uint64_t interval;   // ns between decisions
+    uint64_t start;      // this interval's start
+    uint64_t last;       // the last change of depth
+    uint64_t area;       // depth integrated over time, item-ns
+    int least;           // least depth this interval
+    unsigned long gets;  // items taken this interval
+    uint64_t put_wait;   // ns producers waited for room, summed over threads
+    uint64_t get_wait;   // ns consumers waited for data, summed over threads
+} Adapt;
 
 // Structure to represent mtq
 typedef struct
@@ -13,87 +44,486 @@ typedef struct
     pthread_cond_t consumed; // signals when data has been consumed from mtq
     pthread_cond_t produced; // signals when new data has been produced to the queue
     Deq q;
+    MtqPolicy policy;        // what a put does when the mtq is full
+    DeqMapF evict;           // frees an item dropped by the policy; may be 0
+    int timeout;             // ms a MtqTimeout put waits for room
+    MtqStats stats;          // guarded by lock
+    int readable;            // eventfd: empty to non-empty, or -1
+    int writable;            // eventfd: full to not full, or -1
+    Adapt *adapt;            // moves max, or 0
+    int closed;              // set by mtq_close
 } *Mrep;
 
 /**
- * Creates a new mtq with a maximum size.
+ * Creates a new mtq with a maximum size and an overflow policy.
  *
- * @param mtqMax The maximum number of elements the mtq can hold.
+ * @param mtqMax The maximum number of elements the mtq can hold (0 = unbounded).
+ * @param policy What a put does when the mtq is full.
+ * @param evict Frees items dropped by MtqDropNewest or MtqDropOldest; may be 0.
+ * @param timeout_ms How long a MtqTimeout put waits for room.
  * @return new mtq object.
  */
-Mtq mtq_new(int mtqMax)
+Mtq mtq_new_policy(int mtqMax, MtqPolicy policy, DeqMapF evict, int timeout_ms)
 {
     Mrep mtq = (Mrep)malloc(sizeof(*mtq));
     if (!mtq)
     {
         ERROR("Failed malloc for mtq");
     }
+    mem_add(MemQueue, sizeof(*mtq));
 
     mtq->q = deq_new();
     mtq->max = mtqMax;
+    mtq->policy = policy;
+    mtq->evict = evict;
+    mtq->timeout = timeout_ms;
+    memset(&mtq->stats, 0, sizeof(mtq->stats));
+    mtq->readable = mtq->writable = -1;
+    mtq->adapt = 0;
+    mtq->closed = 0;
+    mtq->stats.capacity = mtqMax;
 
     if (pthread_mutex_init(&mtq->lock, NULL) != 0)
     {
         ERROR("Failed lock initialization");
     }
 
-    if (pthread_cond_init(&mtq->consumed, NULL) != 0)
+    // timed waits measure against the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    if (pthread_cond_init(&mtq->consumed, &attr) != 0)
     {
         ERROR("Failed initialization of consumed variable");
     }
 
-    if (pthread_cond_init(&mtq->produced, NULL) != 0)
+    if (pthread_cond_init(&mtq->produced, &attr) != 0)
     {
         ERROR("Failed initialization of produced variable");
     }
 
+    pthread_condattr_destroy(&attr);
     return (Mtq)mtq;
 }
 
 /**
- * Inserts data at the head of the mtq.
- * This function is thread-safe, meaning it locks the queue during insertion.
- * If the queue is full, it will wait until space is available.
+ * Creates a new mtq with a maximum size, whose puts block when it is full.
  *
- * @param mtq The mtq where the data will be inserted.
- * @param d The data to insert at the head of the mtq.
+ * @param mtqMax The maximum number of elements the mtq can hold.
+ * @return new mtq object.
  */
-void mtq_head_put(Mtq mtq, Data d)
+Mtq mtq_new(int mtqMax)
 {
-    Mrep rep = (Mrep)(mtq);
+    return mtq_new_policy(mtqMax, MtqBlock, 0, 0);
+}
+
+/**
+ * Maps a policy name (block, reject, drop-newest, drop-oldest, timeout)
+ * to its MtqPolicy.
+ *
+ * @param name The policy name.
+ * @return The policy.
+ */
+MtqPolicy mtq_policy(const char *name)
+{
+    static const char *names[] = {"block", "reject", "drop-newest", "drop-oldest", "timeout"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+    {
+        if (!strcmp(name, names[i]))
+        {
+            return (MtqPolicy)i;
+        }
+    }
+    ERROR("unknown overflow policy: %s", name);
+    return MtqBlock;
+}
+
+/**
+ * Takes the mtq's lock, profiling the wait for it.
+ *
+ * @param rep The mtq.
+ */
+static void acquire(Mrep rep)
+{
+    PROF_SCOPE("mtq lock");
     pthread_mutex_lock(&rep->lock);
+}
 
-    while (deq_len(rep->q) >= rep->max && rep->max > 0)
+/**
+ * Waits on a condition variable or, in a simulation, for the scheduler
+ * to wake the caller on its behalf.
+ *
+ * @param cv The condition variable.
+ * @param lock The mutex the caller holds.
+ */
+static void condwait(pthread_cond_t *cv, pthread_mutex_t *lock)
+{
+    if (!vclock_wait(cv, lock, 0, 0))
     {
-        pthread_cond_wait(&rep->consumed, &rep->lock);
+        pthread_cond_wait(cv, lock);
     }
+}
 
-    deq_head_put(rep->q, d);
-    pthread_cond_signal(&rep->produced);
+/**
+ * Signals or broadcasts a condition variable, and wakes any simulated
+ * threads waiting on it.
+ *
+ * @param cv The condition variable.
+ * @param all Nonzero to wake every waiter.
+ */
+static void wake(pthread_cond_t *cv, int all)
+{
+    vclock_wake(cv, all);
+    if (all)
+    {
+        pthread_cond_broadcast(cv);
+    }
+    else
+    {
+        pthread_cond_signal(cv);
+    }
+}
+
+/**
+ * Waits on one of the mtq's condition variables, counting the waiting
+ * thread and timing its wait for the metrics endpoint.
+ *
+ * @param rep The mtq, whose lock the caller holds.
+ * @param producer Nonzero to wait for room, else for data.
+ */
+static void waitfor(Mrep rep, int producer)
+{
+    uint64_t t0 = now_ns();
+    if (producer)
+    {
+        TRACE_SCOPE("mtq wait for room");
+        PROF_SCOPE("mtq wait for room");
+        GAUGE(PRODUCERS, 1);
+        condwait(&rep->consumed, &rep->lock);
+        GAUGE(PRODUCERS, -1);
+        OBSERVE("wam_mtq_put_wait_seconds", "time a put waited for room", now_ns() - t0);
+        if (rep->adapt)
+        {
+            rep->adapt->put_wait += now_ns() - t0;
+        }
+    }
+    else
+    {
+        TRACE_SCOPE("mtq wait for data");
+        PROF_SCOPE("mtq wait for data");
+        GAUGE(CONSUMERS, 1);
+        condwait(&rep->produced, &rep->lock);
+        GAUGE(CONSUMERS, -1);
+        OBSERVE("wam_mtq_get_wait_seconds", "time a get waited for data", now_ns() - t0);
+        if (rep->adapt)
+        {
+            rep->adapt->get_wait += now_ns() - t0;
+        }
+    }
+}
+
+/**
+ * Adjusts an adaptive mtq's capacity at the end of an interval, CoDel
+ * fashion. By Little's law, the mean sojourn is the mean depth over the
+ * throughput, and the standing sojourn, which even the luckiest item
+ * spent queued, is the least depth over the throughput. If the standing
+ * sojourn is above target, items are going stale behind a queue that
+ * never drains, so the capacity shrinks; if it is below target and
+ * producers spent longer waiting for room than consumers spent waiting
+ * for data, the capacity is what stalls them, so it grows. Each decision,
+ * and what it was based on, is kept in the stats. Called under the lock.
+ *
+ * @param rep The mtq.
+ * @param now The interval's end.
+ */
+static void decide(Mrep rep, uint64_t now)
+{
+    Adapt *a = rep->adapt;
+    MtqStats *s = &rep->stats;
+    uint64_t dt = now - a->start;
+    s->decisions++;
+    s->sojourn_ms = a->gets ? a->area / 1e6 / a->gets : 0;
+    s->standing_ms = a->gets ? (double)a->least * dt / 1e6 / a->gets : 0;
+    s->put_wait = (double)a->put_wait / dt;
+    s->get_wait = (double)a->get_wait / dt;
+
+    int max = rep->max;
+    if (!a->gets)
+    {
+        // nothing left, so nothing to learn: consumers stalled, or no load
+    }
+    else if (s->standing_ms * 1e6 > a->target)
+    {
+        max -= max / 4 > 1 ? max / 4 : 1;
+    }
+    else if (a->put_wait > a->get_wait)
+    {
+        max += max / 2 > 1 ? max / 2 : 1;
+    }
+    max = max < a->lo ? a->lo : max > a->hi ? a->hi : max;
+    if (max < rep->max)
+    {
+        s->shrunk++;
+        COUNT("wam_mtq_shrunk_total", "adaptive mtq capacity decreases", 1);
+    }
+    else if (max > rep->max)
+    {
+        s->grown++;
+        COUNT("wam_mtq_grown_total", "adaptive mtq capacity increases", 1);
+        // room, for producers and for an attached eventfd
+        wake(&rep->consumed, 1);
+        if (deq_len(rep->q) >= rep->max && deq_len(rep->q) < max && rep->writable >= 0)
+        {
+            eventfd_write(rep->writable, 1);
+        }
+    }
+    GAUGE("wam_mtq_capacity", "adaptive mtq capacities, summed", max - rep->max);
+    rep->max = s->capacity = max;
+
+    a->start = now;
+    a->area = 0;
+    a->least = deq_len(rep->q);
+    a->gets = 0;
+    a->put_wait = a->get_wait = 0;
+}
+
+/**
+ * Feeds a change of depth to an adaptive mtq's controller, and lets it
+ * decide once an interval has passed. Called under the lock.
+ *
+ * @param rep The mtq.
+ * @param before The depth before the change.
+ * @param after The depth after it.
+ * @param n Items put, or minus the items taken.
+ * @param served Nonzero if items taken went to consumers, not evicted
+ *               or taken for a snapshot: only those count as throughput.
+ */
+static void measure(Mrep rep, int before, int after, int n, int served)
+{
+    Adapt *a = rep->adapt;
+    uint64_t now = now_ns();
+    a->area += (uint64_t)before * (now - a->last);
+    a->last = now;
+    if (after < a->least)
+    {
+        a->least = after;
+    }
+    if (n < 0 && served)
+    {
+        a->gets -= n;
+    }
+    if (now - a->start >= a->interval)
+    {
+        decide(rep, now);
+    }
+}
+
+/**
+ * Accounts for items put into or taken out of the mtq: counts them for the
+ * metrics endpoint, and signals an attached eventfd if the mtq went from
+ * empty to non-empty, or from full to not full. Called under the lock.
+ *
+ * @param rep The mtq, after the change.
+ * @param n Items put, or minus the items taken.
+ * @param served Nonzero unless the items taken were evicted, or taken
+ *               for a snapshot.
+ */
+static void change(Mrep rep, int n, int served)
+{
+    int after = deq_len(rep->q), before = after - n;
+    if (rep->adapt)
+    {
+        measure(rep, before, after, n, served);
+    }
+    if (n > 0)
+    {
+        COUNT("wam_mtq_puts_total", "items put into an mtq", n);
+        if (before == 0 && rep->readable >= 0)
+        {
+            eventfd_write(rep->readable, 1);
+        }
+    }
+    else
+    {
+        COUNT("wam_mtq_gets_total", "items taken from an mtq", -n);
+        if (rep->max > 0 && before >= rep->max && after < rep->max && rep->writable >= 0)
+        {
+            eventfd_write(rep->writable, 1);
+        }
+    }
+    GAUGE(DEPTH, n);
+}
+
+/* Accounts for items put, or taken by consumers; see change() */
+static void moved(Mrep rep, int n)
+{
+    change(rep, n, 1);
+}
+
+/* Accounts for n items taken out other than by consumers; see change() */
+static void removed(Mrep rep, int n)
+{
+    change(rep, -n, 0);
+}
+
+/**
+ * Inserts data at one end of the mtq, applying the overflow policy if it
+ * is full. An evicted item is freed after the lock is released. A put
+ * evicts one item at most: if an adaptive mtq's capacity has shrunk below
+ * its depth, a drop-oldest put replaces its oldest item, and gets bring
+ * the depth down.
+ *
+ * @param rep The mtq where the data will be inserted.
+ * @param head Nonzero to insert at the head, else at the tail.
+ * @param d The data to insert.
+ * @param policy The overflow policy to apply.
+ * @return MtqOk, or what the policy did instead.
+ */
+static MtqStatus put(Mrep rep, int head, Data d, MtqPolicy policy, int force)
+{
+    MtqStatus status = MtqOk;
+    Data evicted = 0;
+    uint64_t until = 0;
+
+    acquire(rep);
+    if (policy == MtqTimeout)
+    {
+        // the conds use CLOCK_MONOTONIC, as now_ns() does outside a simulation
+        until = now_ns() + rep->timeout * 1000000ULL;
+    }
+    if (rep->closed && !force)
+    {
+        status = MtqClosed;
+    }
+
+    while (deq_len(rep->q) >= rep->max && rep->max > 0 && status == MtqOk && !rep->closed && !evicted)
+    {
+        switch (policy)
+        {
+        case MtqBlock:
+            waitfor(rep, 1);
+            break;
+        case MtqTimeout:
+        {
+            TRACE_SCOPE("mtq timed wait for room");
+            PROF_SCOPE("mtq timed wait for room");
+            GAUGE(PRODUCERS, 1);
+            int timedout;
+            uint64_t t0 = now_ns();
+            if (!vclock_wait(&rep->consumed, &rep->lock, until, &timedout))
+            {
+                struct timespec deadline = {until / 1000000000, until % 1000000000};
+                timedout = pthread_cond_timedwait(&rep->consumed, &rep->lock, &deadline) == ETIMEDOUT;
+            }
+            if (rep->adapt)
+            {
+                rep->adapt->put_wait += now_ns() - t0;
+            }
+            if (rep->closed && !force)
+            {
+                status = MtqClosed;
+            }
+            else if (timedout && deq_len(rep->q) >= rep->max && !rep->closed)
+            {
+                rep->stats.timeouts++;
+                status = MtqTimedOut;
+            }
+            GAUGE(PRODUCERS, -1);
+            break;
+        }
+        case MtqReject:
+            rep->stats.rejected++;
+            status = MtqFull;
+            break;
+        case MtqDropNewest:
+            rep->stats.dropped_newest++;
+            evicted = d;
+            status = MtqDropped;
+            break;
+        case MtqDropOldest:
+            // the oldest item is at the end opposite the one being put to
+            rep->stats.dropped_oldest++;
+            evicted = head ? deq_tail_get(rep->q) : deq_head_get(rep->q);
+            removed(rep, 1);
+            break;
+        }
+    }
+
+    if (status == MtqOk)
+    {
+        if (head)
+        {
+            deq_head_put(rep->q, d);
+        }
+        else
+        {
+            deq_tail_put(rep->q, d);
+        }
+        rep->stats.puts++;
+        moved(rep, 1);
+        wake(&rep->produced, 0);
+    }
+    else if (status == MtqClosed)
+    {
+        rep->stats.closed++;
+    }
     pthread_mutex_unlock(&rep->lock);
+
+    if ((status != MtqOk && status != MtqClosed) || evicted)
+    {
+        COUNT("wam_mtq_shed_total", "items an overflow policy refused or evicted", 1);
+    }
+
+    if (evicted && rep->evict)
+    {
+        rep->evict(evicted);
+    }
+    return status;
+}
+
+/**
+ * Inserts data at the head of the mtq.
+ * This function is thread-safe, meaning it locks the queue during insertion.
+ * If the queue is full, the mtq's overflow policy decides what happens.
+ *
+ * @param mtq The mtq where the data will be inserted.
+ * @param d The data to insert at the head of the mtq.
+ * @return MtqOk, or what the policy did instead.
+ */
+MtqStatus mtq_head_put(Mtq mtq, Data d)
+{
+    Mrep rep = (Mrep)(mtq);
+    return put(rep, 1, d, rep->policy, 0);
 }
 
 /**
  * Inserts data at the tail of the mtq.
  * This function is thread-safe, meaning it locks the queue during insertion.
- * If the queue is full, it will wait until space is available.
+ * If the queue is full, the mtq's overflow policy decides what happens.
  *
  * @param mtq The mtq where the data will be inserted.
  * @param d The data to insert at the tail of the mtq.
+ * @return MtqOk, or what the policy did instead.
  */
-void mtq_tail_put(Mtq mtq, Data d)
+MtqStatus mtq_tail_put(Mtq mtq, Data d)
 {
     Mrep rep = (Mrep)(mtq);
-    pthread_mutex_lock(&rep->lock);
-
-    while (deq_len(rep->q) >= rep->max && rep->max > 0)
-    {
-        pthread_cond_wait(&rep->consumed, &rep->lock);
-    }
+    return put(rep, 0, d, rep->policy, 0);
+}
 
-    deq_tail_put(rep->q, d);
-    pthread_cond_signal(&rep->produced);
-    pthread_mutex_unlock(&rep->lock);
+/**
+ * Inserts data at the tail of the mtq, waiting for room whatever the
+ * overflow policy, so the item can be neither refused nor evicted on the
+ * way in. Meant for control items, such as end-of-work markers. Once the
+ * mtq is closed, it puts without waiting, past the capacity if need be.
+ *
+ * @param mtq The mtq where the data will be inserted.
+ * @param d The data to insert at the tail of the mtq.
+ */
+void mtq_tail_put_wait(Mtq mtq, Data d)
+{
+    put((Mrep)(mtq), 0, d, MtqBlock, 1);
 }
 
 /**
@@ -102,21 +532,30 @@ void mtq_tail_put(Mtq mtq, Data d)
  * If the queue is empty, it will wait until data is available.
  *
  * @param mtq The mtq to retrieve the data from.
- * @return The data removed from the head of the mtq.
+ * @return The data removed from the head of the mtq, or 0 once it is
+ *         closed and empty.
  */
 Data mtq_head_get(Mtq mtq)
 {
     Mrep rep = (Mrep)(mtq);
     Data returnData;
 
-    pthread_mutex_lock(&rep->lock);
-    while (deq_len(rep->q) == 0)
+    acquire(rep);
+    while (deq_len(rep->q) == 0 && !rep->closed)
+    {
+        waitfor(rep, 0);
+    }
+    if (deq_len(rep->q) == 0)
     {
-        pthread_cond_wait(&rep->produced, &rep->lock);
+        // closed, and drained
+        pthread_mutex_unlock(&rep->lock);
+        return 0;
     }
 
     returnData = deq_head_get(rep->q);
-    pthread_cond_signal(&rep->consumed);
+    rep->stats.gets++;
+    moved(rep, -1);
+    wake(&rep->consumed, 0);
     pthread_mutex_unlock(&rep->lock);
 
     return returnData;
@@ -128,26 +567,147 @@ Data mtq_head_get(Mtq mtq)
  * If the queue is empty, it waits until data is available.
  *
  * @param mtq The mtq to retrieve the data from.
- * @return The data removed from the tail of the mtq.
+ * @return The data removed from the tail of the mtq, or 0 once it is
+ *         closed and empty.
  */
 Data mtq_tail_get(Mtq mtq)
 {
     Mrep rep = (Mrep)(mtq);
     Data returnData;
 
-    pthread_mutex_lock(&rep->lock);
-    while (deq_len(rep->q) == 0)
+    acquire(rep);
+    while (deq_len(rep->q) == 0 && !rep->closed)
     {
-        pthread_cond_wait(&rep->produced, &rep->lock);
+        waitfor(rep, 0);
+    }
+    if (deq_len(rep->q) == 0)
+    {
+        // closed, and drained
+        pthread_mutex_unlock(&rep->lock);
+        return 0;
     }
 
     returnData = deq_tail_get(rep->q);
-    pthread_cond_signal(&rep->consumed);
+    rep->stats.gets++;
+    moved(rep, -1);
+    wake(&rep->consumed, 0);
     pthread_mutex_unlock(&rep->lock);
 
     return returnData;
 }
 
+/**
+ * Retrieves and removes up to n items from the head of the mtq, under one
+ * lock acquisition. It waits until at least one item is available, and
+ * stops after taking a 0, so each end-of-work marker reaches one caller.
+ * Once the mtq is closed and empty, it takes a 0, as if a marker.
+ *
+ * @param mtq The mtq to retrieve the data from.
+ * @param out Where to store the items.
+ * @param n The most items to take.
+ * @return The number of items taken, at least 1.
+ */
+int mtq_head_getn(Mtq mtq, Data *out, int n)
+{
+    Mrep rep = (Mrep)(mtq);
+    int got = 0;
+
+    acquire(rep);
+    while (deq_len(rep->q) == 0 && !rep->closed)
+    {
+        waitfor(rep, 0);
+    }
+    if (deq_len(rep->q) == 0)
+    {
+        // closed, and drained: a 0, as if an end-of-work marker
+        pthread_mutex_unlock(&rep->lock);
+        out[0] = 0;
+        return 1;
+    }
+
+    while (got < n && deq_len(rep->q) > 0)
+    {
+        out[got] = deq_head_get(rep->q);
+        if (!out[got++])
+        {
+            break;
+        }
+    }
+    rep->stats.gets += got;
+    moved(rep, -got);
+    wake(&rep->consumed, 1);
+    pthread_mutex_unlock(&rep->lock);
+
+    return got;
+}
+
+/**
+ * Inserts n items at the tail of the mtq, as many per lock acquisition as
+ * there is room for, waiting for room whatever the overflow policy.
+ *
+ * @param mtq The mtq where the data will be inserted.
+ * @param d The items to insert, in order.
+ * @param n The number of items.
+ */
+void mtq_tail_putn(Mtq mtq, Data *d, int n)
+{
+    Mrep rep = (Mrep)(mtq);
+
+    acquire(rep);
+    for (int i = 0; i < n;)
+    {
+        while (deq_len(rep->q) >= rep->max && rep->max > 0 && !rep->closed)
+        {
+            waitfor(rep, 1);
+        }
+        int put = 0;
+        while (i < n && (deq_len(rep->q) < rep->max || rep->max == 0 || rep->closed))
+        {
+            deq_tail_put(rep->q, d[i++]);
+            put++;
+        }
+        rep->stats.puts += put;
+        moved(rep, put);
+        if (put > 1)
+        {
+            wake(&rep->produced, 1);
+        }
+        else
+        {
+            wake(&rep->produced, 0);
+        }
+    }
+    pthread_mutex_unlock(&rep->lock);
+}
+
+/**
+ * Inserts n items at the tail of the mtq, under one lock acquisition,
+ * past the capacity if need be, whatever the overflow policy. Meant for
+ * items admitted before, such as those of a restored snapshot: producers
+ * wait for room until consumers have taken the mtq back under capacity.
+ *
+ * @param mtq The mtq where the data will be inserted.
+ * @param d The items to insert, in order.
+ * @param n The number of items.
+ */
+void mtq_tail_putall(Mtq mtq, Data *d, int n)
+{
+    Mrep rep = (Mrep)(mtq);
+
+    acquire(rep);
+    for (int i = 0; i < n; i++)
+    {
+        deq_tail_put(rep->q, d[i]);
+    }
+    if (n > 0)
+    {
+        rep->stats.puts += n;
+        moved(rep, n);
+        wake(&rep->produced, 1);
+    }
+    pthread_mutex_unlock(&rep->lock);
+}
+
 /**
  * Retrieves an element from a specific position from the head of the mtq.
  * This function is thread-safe, locking the queue during the retrieval.
@@ -162,14 +722,14 @@ Data mtq_head_ith(Mtq mtq, int i)
     Mrep rep = (Mrep)(mtq);
     Data returnData;
 
-    pthread_mutex_lock(&rep->lock);
-    while (deq_len(rep->q) - 1 < i)
+    acquire(rep);
+    while (deq_len(rep->q) - 1 < i && !rep->closed)
     {
-        pthread_cond_wait(&rep->produced, &rep->lock);
+        waitfor(rep, 0);
     }
 
-    returnData = deq_head_ith(rep->q, i);
-    pthread_cond_signal(&rep->consumed);
+    returnData = deq_len(rep->q) - 1 < i ? 0 : deq_head_ith(rep->q, i);
+    wake(&rep->consumed, 0);
     pthread_mutex_unlock(&rep->lock);
 
     return returnData;
@@ -189,14 +749,14 @@ Data mtq_tail_ith(Mtq mtq, int i)
     Mrep rep = (Mrep)(mtq);
     Data returnData;
 
-    pthread_mutex_lock(&rep->lock);
-    while (deq_len(rep->q) - 1 < i)
+    acquire(rep);
+    while (deq_len(rep->q) - 1 < i && !rep->closed)
     {
-        pthread_cond_wait(&rep->produced, &rep->lock);
+        waitfor(rep, 0);
     }
 
-    returnData = deq_tail_ith(rep->q, i);
-    pthread_cond_signal(&rep->consumed);
+    returnData = deq_len(rep->q) - 1 < i ? 0 : deq_tail_ith(rep->q, i);
+    wake(&rep->consumed, 0);
     pthread_mutex_unlock(&rep->lock);
 
     return returnData;
@@ -216,14 +776,18 @@ Data mtq_head_rem(Mtq mtq, Data d)
     Mrep rep = (Mrep)(mtq);
     Data returnData;
 
-    pthread_mutex_lock(&rep->lock);
-    while (deq_len(rep->q) == 0)
+    acquire(rep);
+    while (deq_len(rep->q) == 0 && !rep->closed)
     {
-        pthread_cond_wait(&rep->produced, &rep->lock);
+        waitfor(rep, 0);
     }
 
     returnData = deq_head_rem(rep->q, d);
-    pthread_cond_signal(&rep->consumed);
+    if (returnData)
+    {
+        moved(rep, -1);
+    }
+    wake(&rep->consumed, 0);
     pthread_mutex_unlock(&rep->lock);
 
     return returnData;
@@ -243,19 +807,257 @@ Data mtq_tail_rem(Mtq mtq, Data d)
     Mrep rep = (Mrep)(mtq);
     Data returnData;
 
-    pthread_mutex_lock(&rep->lock);
-    while (deq_len(rep->q) == 0)
+    acquire(rep);
+    while (deq_len(rep->q) == 0 && !rep->closed)
     {
-        pthread_cond_wait(&rep->produced, &rep->lock);
+        waitfor(rep, 0);
     }
 
     returnData = deq_tail_rem(rep->q, d);
-    pthread_cond_signal(&rep->consumed);
+    if (returnData)
+    {
+        moved(rep, -1);
+    }
+    wake(&rep->consumed, 0);
     pthread_mutex_unlock(&rep->lock);
 
     return returnData;
 }
 
+/**
+ * Takes the item at the head of the mtq, if there is one, without waiting.
+ *
+ * @param mtq The mtq to retrieve the data from.
+ * @param d Where to store the item.
+ * @return 1 if an item was taken, 0 if the mtq was empty.
+ */
+int mtq_head_tryget(Mtq mtq, Data *d)
+{
+    Mrep rep = (Mrep)(mtq);
+    int got = 0;
+
+    acquire(rep);
+    if (deq_len(rep->q) > 0)
+    {
+        *d = deq_head_get(rep->q);
+        rep->stats.gets++;
+        moved(rep, -1);
+        wake(&rep->consumed, 0);
+        got = 1;
+    }
+    pthread_mutex_unlock(&rep->lock);
+
+    return got;
+}
+
+/**
+ * Inserts data at the tail of the mtq, if there is room, without waiting
+ * and whatever the overflow policy.
+ *
+ * @param mtq The mtq where the data will be inserted.
+ * @param d The data to insert.
+ * @return MtqOk, or MtqFull or MtqClosed if the caller keeps the item.
+ */
+MtqStatus mtq_tail_tryput(Mtq mtq, Data d)
+{
+    Mrep rep = (Mrep)(mtq);
+    MtqStatus status = MtqFull;
+
+    acquire(rep);
+    if (rep->closed)
+    {
+        status = MtqClosed;
+    }
+    else if (deq_len(rep->q) < rep->max || rep->max == 0)
+    {
+        deq_tail_put(rep->q, d);
+        rep->stats.puts++;
+        moved(rep, 1);
+        wake(&rep->produced, 0);
+        status = MtqOk;
+    }
+    pthread_mutex_unlock(&rep->lock);
+
+    return status;
+}
+
+/**
+ * Returns an eventfd that becomes readable when the mtq goes from empty
+ * to non-empty (or, for writable, from full to not full), creating it on
+ * first use. Signals coalesce in the eventfd's counter, so a waiter should
+ * read the eventfd, then take (or put) items until none are left (or no
+ * room is), before waiting again; that suits epoll's edge-triggered mode.
+ * The mtq owns the eventfd and closes it in mtq_del.
+ *
+ * @param mtq The mtq to watch.
+ * @param writable Nonzero for room to put, else for items to get.
+ * @return The eventfd, which is non-blocking.
+ */
+int mtq_eventfd(Mtq mtq, int writable)
+{
+    Mrep rep = (Mrep)(mtq);
+    acquire(rep);
+    int *fd = writable ? &rep->writable : &rep->readable;
+    if (*fd < 0)
+    {
+        *fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (*fd < 0)
+        {
+            ERROR("eventfd() failed: %s", strerror(errno));
+        }
+        // start ready, if the mtq already is, or is closed
+        if (rep->closed || (writable ? rep->max == 0 || deq_len(rep->q) < rep->max : deq_len(rep->q) > 0))
+        {
+            eventfd_write(*fd, 1);
+        }
+    }
+    pthread_mutex_unlock(&rep->lock);
+    return *fd;
+}
+
+/**
+ * Closes the mtq, for shutdown, and wakes every thread waiting on it.
+ * From then on, no operation waits: puts are refused with MtqClosed,
+ * except mtq_tail_put_wait and mtq_tail_putn, which put past the
+ * capacity, so nothing already in flight is lost; gets take what is left,
+ * then return 0, as if each had taken an end-of-work marker. Attached
+ * eventfds are signalled, so an event loop wakes and sees the same.
+ * Closing twice is harmless.
+ *
+ * @param mtq The mtq.
+ */
+void mtq_close(Mtq mtq)
+{
+    Mrep rep = (Mrep)(mtq);
+    acquire(rep);
+    rep->closed = 1;
+    wake(&rep->produced, 1);
+    wake(&rep->consumed, 1);
+    if (rep->readable >= 0)
+    {
+        eventfd_write(rep->readable, 1);
+    }
+    if (rep->writable >= 0)
+    {
+        eventfd_write(rep->writable, 1);
+    }
+    pthread_mutex_unlock(&rep->lock);
+}
+
+/**
+ * Calls a function on each item in the mtq, from head to tail, under its
+ * lock, so that the items seen are the mtq's contents at one instant,
+ * as for a snapshot. The function must not use the mtq, nor allocate.
+ *
+ * @param mtq The mtq.
+ * @param f Called with each item and arg.
+ * @param arg Passed to f.
+ * @param take Nonzero to take the items out as well, up to max of them.
+ * @param max With take, the most items to take; 0 for all.
+ * @return The number of items in the mtq, or, with take, taken.
+ */
+int mtq_map(Mtq mtq, DeqEachF f, void *arg, int take, int max)
+{
+    Mrep rep = (Mrep)(mtq);
+    acquire(rep);
+    int n = deq_len(rep->q);
+    if (!take)
+    {
+        deq_each(rep->q, f, arg);
+    }
+    else
+    {
+        if (max > 0 && n > max)
+        {
+            n = max;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            f(deq_head_get(rep->q), arg);
+        }
+        if (n > 0)
+        {
+            rep->stats.gets += n;
+            removed(rep, n);
+            wake(&rep->consumed, 1);
+        }
+    }
+    pthread_mutex_unlock(&rep->lock);
+    return n;
+}
+
+/**
+ * Makes the mtq's capacity adaptive: from now on, it is adjusted every
+ * interval, within bounds, to keep the standing sojourn of its items
+ * under a target while producers do not stall for room. The mtq's
+ * capacity so far, clamped to the bounds, is where it starts.
+ *
+ * @param mtq The mtq, which should not be unbounded.
+ * @param lo The least capacity.
+ * @param hi The greatest capacity.
+ * @param target_ms The standing sojourn tolerated.
+ * @param interval_ms The time between adjustments.
+ */
+void mtq_adapt(Mtq mtq, int lo, int hi, int target_ms, int interval_ms)
+{
+    Mrep rep = (Mrep)(mtq);
+    if (lo < 1 || hi < lo || interval_ms < 1)
+    {
+        ERROR("adaptive mtq: need 1 <= lo <= hi, and an interval");
+    }
+    Adapt *a = (Adapt *)calloc(1, sizeof(*a));
+    if (!a)
+    {
+        ERROR("Failed calloc for adaptive mtq");
+    }
+    a->lo = lo;
+    a->hi = hi;
+    a->target = target_ms * 1000000ULL;
+    a->interval = interval_ms * 1000000ULL;
+
+    acquire(rep);
+    int max = rep->max < lo ? lo : rep->max > hi || rep->max == 0 ? hi : rep->max;
+    GAUGE("wam_mtq_capacity", "adaptive mtq capacities, summed", max);
+    if (max > rep->max && rep->max > 0)
+    {
+        wake(&rep->consumed, 1);
+    }
+    rep->max = rep->stats.capacity = max;
+    a->start = a->last = now_ns();
+    a->least = deq_len(rep->q);
+    rep->adapt = a;
+    pthread_mutex_unlock(&rep->lock);
+}
+
+/**
+ * Returns the number of items in the mtq, a snapshot taken under its lock.
+ *
+ * @param mtq The mtq to measure.
+ * @return The number of items in the mtq.
+ */
+int mtq_len(Mtq mtq)
+{
+    Mrep rep = (Mrep)(mtq);
+    acquire(rep);
+    int len = deq_len(rep->q);
+    pthread_mutex_unlock(&rep->lock);
+    return len;
+}
+
+/**
+ * Copies the mtq's counters, taken under its lock.
+ *
+ * @param mtq The mtq to report on.
+ * @param stats Where to copy the counters.
+ */
+void mtq_stats(Mtq mtq, MtqStats *stats)
+{
+    Mrep rep = (Mrep)(mtq);
+    acquire(rep);
+    *stats = rep->stats;
+    pthread_mutex_unlock(&rep->lock);
+}
+
 /**
  * Deallocates memory used by the mtq and destroys mutexes and condition variables.
  * Deq deletion included.
@@ -269,6 +1071,21 @@ void mtq_del(Mtq mtq, DeqMapF f)
     pthread_mutex_destroy(&rep->lock);
     pthread_cond_destroy(&rep->produced);
     pthread_cond_destroy(&rep->consumed);
+    GAUGE(DEPTH, -deq_len(rep->q));
+    if (rep->adapt)
+    {
+        GAUGE("wam_mtq_capacity", "adaptive mtq capacities, summed", -rep->max);
+        free(rep->adapt);
+    }
     deq_del(rep->q, f);
+    if (rep->readable >= 0)
+    {
+        close(rep->readable);
+    }
+    if (rep->writable >= 0)
+    {
+        close(rep->writable);
+    }
+    mem_add(MemQueue, -(long)sizeof(*rep));
     free(rep);
 }
\ No newline at end of file
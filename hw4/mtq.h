@@ -1,11 +1,51 @@
+#ifndef MTQ_H
+#define MTQ_H
+
 #include "deq.h"
 
 typedef void* Mtq;
+
+// What a put does when the mtq is full
+typedef enum
+{
+    MtqBlock,      // wait for room
+    MtqReject,     // return MtqFull; the caller keeps the item
+    MtqDropNewest, // evict the item being put
+    MtqDropOldest, // evict the item at the other end, then put
+    MtqTimeout     // wait for room, up to a time limit, then return MtqTimedOut
+} MtqPolicy;
+
+// The result of a put
+typedef enum
+{
+    MtqOk,       // the item was put
+    MtqFull,     // rejected; the caller keeps the item
+    MtqDropped,  // the item was evicted
+    MtqTimedOut, // no room in time; the caller keeps the item
+    MtqClosed    // the mtq is closed; the caller keeps the item
+} MtqStatus;
+
+// Counts of what the mtq has done
+typedef struct
+{
+    unsigned long puts, gets;
+    unsigned long rejected, dropped_newest, dropped_oldest, timeouts;
+    int capacity;                       // max, which an adaptive mtq moves
+    unsigned long decisions, grown, shrunk; // an adaptive mtq's adjustments
+    // what the latest adjustment was based on, over its interval
+    double sojourn_ms, standing_ms;     // mean and least queueing time, by Little's law
+    double put_wait, get_wait;          // producers waiting for room, and consumers for data, per second
+    unsigned long closed;               // puts refused because the mtq was closed
+} MtqStats;
+
 void mtq_del(Mtq, DeqMapF);
 Mtq mtq_new(int);
+Mtq mtq_new_policy(int, MtqPolicy, DeqMapF evict, int timeout_ms);
+MtqPolicy mtq_policy(const char *name);
 
-void mtq_tail_put(Mtq, Data);
-void mtq_head_put(Mtq, Data);
+MtqStatus mtq_tail_put(Mtq, Data);
+MtqStatus mtq_head_put(Mtq, Data);
+void mtq_tail_put_wait(Mtq, Data); // blocks for room, whatever the policy; once closed, puts past it
 
 Data mtq_head_get(Mtq);
 Data mtq_tail_get(Mtq);
@@ -13,4 +53,26 @@ Data mtq_head_ith(Mtq, int);
 Data mtq_tail_ith(Mtq, int);
 
 Data mtq_tail_rem(Mtq, Data);
-Data mtq_head_rem(Mtq, Data);
\ No newline at end of file
+Data mtq_head_rem(Mtq, Data);
+
+int mtq_head_getn(Mtq, Data *, int); // 1..n items, stopping after a 0
+void mtq_tail_putn(Mtq, Data *, int); // blocks for room, whatever the policy
+void mtq_tail_putall(Mtq, Data *, int); // never blocks: past the capacity, if need be
+
+int mtq_head_tryget(Mtq, Data *);       // 0 if empty, without waiting
+MtqStatus mtq_tail_tryput(Mtq, Data);   // MtqFull if full, without waiting
+int mtq_eventfd(Mtq, int writable);     // signals readiness, for epoll
+
+// capacity bounds, target standing sojourn, and adjustment interval
+void mtq_adapt(Mtq, int lo, int hi, int target_ms, int interval_ms);
+
+// wakes every waiter: puts are refused, and gets return 0 once it is empty
+void mtq_close(Mtq);
+
+// calls f on each item, head to tail, under the lock; with take, takes up to max (0 = all) out too
+int mtq_map(Mtq, DeqEachF f, void *arg, int take, int max);
+
+int mtq_len(Mtq);
+void mtq_stats(Mtq, MtqStats *);
+
+#endif
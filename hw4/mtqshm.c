@@ -0,0 +1,435 @@
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mtqshm.h"
+
+#define MAGIC 0x514d4157u // "WAMQ", little-endian
+#define VERSION 3
+#define PIDS 64           // producer processes registered at once
+#define REAP_MS 100       // how often a waiting consumer looks for dead producers
+
+// The shared layout
+typedef struct
+{
+    uint32_t magic;          // set last, by the creator, once the rest is ready
+    uint32_t version;
+    uint32_t max;            // slots
+    uint32_t slot_size;      // bytes per slot
+    pthread_mutex_t lock;    // robust and process-shared
+    uint32_t consumed;       // futex: bumped when a slot has been freed
+    uint32_t produced;       // futex: bumped when a slot has been filled
+    uint64_t head, tail;     // items taken, and items put; guarded by lock
+    uint32_t producers;      // processes registered to put; guarded by lock
+    uint32_t finished;       // of them, those done putting, or dead; guarded by lock
+    pid_t pids[PIDS];        // those not yet finished, 0 for a free entry; guarded by lock
+    char slots[];            // max * slot_size
+} Shared;
+
+// One process's handle
+typedef struct
+{
+    Shared *s;
+    size_t len;
+    char *name;
+    int leaving;             // this process's waits end; guarded by the shared lock
+} *Srep;
+
+/**
+ * Locks the queue. If the last holder died holding the lock, the queue is
+ * still consistent, since head and tail only move after their slot is
+ * complete, so the lock is marked consistent and taken.
+ *
+ * @param s The shared queue.
+ */
+static void lock(Shared *s)
+{
+    int rc = pthread_mutex_lock(&s->lock);
+    if (rc == EOWNERDEAD)
+    {
+        WARN("mtq: a process died holding the shared lock; recovering");
+        pthread_mutex_consistent(&s->lock);
+    }
+    else if (rc)
+    {
+        ERROR("pthread_mutex_lock() failed: %s", strerror(rc));
+    }
+}
+
+/**
+ * Waits for one of the queue's futex words to be bumped, unlocking the
+ * queue meanwhile. A process-shared condition variable is not used: one
+ * whose waiter dies can block every later signaller, which holds the
+ * lock, for good; a dead futex waiter leaves nothing behind.
+ *
+ * @param s The shared queue, whose lock the caller holds.
+ * @param word s->produced or s->consumed.
+ * @param ms The longest wait, 0 for no limit.
+ */
+static void waitfor(Shared *s, uint32_t *word, int ms)
+{
+    // a bump after the unlock changes the word, so the wait returns at once
+    uint32_t seen = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+    struct timespec t = {ms / 1000, (ms % 1000) * 1000000L};
+    pthread_mutex_unlock(&s->lock);
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, ms ? &t : 0, 0, 0);
+    lock(s);
+}
+
+/**
+ * Bumps one of the queue's futex words, and wakes its waiters. Caller
+ * holds the lock.
+ *
+ * @param word s->produced or s->consumed.
+ * @param all Nonzero to wake every waiter, else one.
+ */
+static void bump(uint32_t *word, int all)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, word, FUTEX_WAKE, all ? INT_MAX : 1, 0, 0, 0);
+}
+
+/**
+ * Returns whether the run is over: some producer registered, every one
+ * has finished, and the queue is empty. Caller holds the lock.
+ *
+ * @param s The shared queue.
+ */
+static int done(Shared *s)
+{
+    return s->producers && s->finished == s->producers && s->tail == s->head;
+}
+
+/**
+ * Counts each registered producer process that has died without
+ * finishing as finished, so that the run can still end, and wakes the
+ * consumers to see that. Caller holds the lock.
+ *
+ * @param s The shared queue.
+ */
+static void reap(Shared *s)
+{
+    for (int i = 0; i < PIDS; i++)
+    {
+        if (s->pids[i] && kill(s->pids[i], 0) && errno == ESRCH)
+        {
+            WARN("mtq: producer process %d died before finishing; counting it finished", (int)s->pids[i]);
+            s->pids[i] = 0;
+            s->finished++;
+            bump(&s->produced, 1);
+        }
+    }
+}
+
+/**
+ * Initializes a new shared queue's lock and indices.
+ *
+ * @param s The region, zero-filled.
+ * @param max Slots.
+ * @param slot_size Bytes per slot.
+ */
+static void init(Shared *s, int max, int slot_size)
+{
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&s->lock, &ma) != 0)
+    {
+        ERROR("Failed lock initialization");
+    }
+    pthread_mutexattr_destroy(&ma);
+
+
+    s->version = VERSION;
+    s->max = max;
+    s->slot_size = slot_size;
+    __atomic_store_n(&s->magic, MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * Maps a queue's region, waiting for its creator to finish initializing
+ * it if need be.
+ *
+ * @param fd The region.
+ * @param name Its name, for errors.
+ * @return The region, mapped in full.
+ */
+static Shared *attach(int fd, const char *name)
+{
+    // the creator sizes the region, then sets magic once the rest is ready
+    Shared *s = MAP_FAILED;
+    for (int i = 0; s == MAP_FAILED || __atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != MAGIC; i++)
+    {
+        if (i == 100)
+        {
+            ERROR("%s: not a shared mtq", name);
+        }
+        if (s == MAP_FAILED && lseek(fd, 0, SEEK_END) >= (off_t)sizeof(Shared))
+        {
+            s = (Shared *)mmap(0, sizeof(Shared), PROT_READ, MAP_SHARED, fd, 0);
+            continue;
+        }
+        usleep(10000);
+    }
+    if (s->version != VERSION)
+    {
+        ERROR("%s: shared mtq version %u, not %u", name, s->version, VERSION);
+    }
+    size_t len = sizeof(Shared) + (size_t)s->max * s->slot_size;
+    munmap(s, sizeof(Shared));
+    s = (Shared *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s == MAP_FAILED)
+    {
+        ERROR("mmap() failed: %s", strerror(errno));
+    }
+    return s;
+}
+
+/**
+ * Opens a shared mtq, creating it if no process has yet. A process that
+ * attaches to an existing queue takes the creator's max; every process
+ * must agree on slot_size.
+ *
+ * @param name The shared-memory name, e.g. "/wam-mtq".
+ * @param max The number of slots, if creating; must be positive.
+ * @param slot_size The bytes each item takes.
+ * @return The queue.
+ */
+MtqShm mtq_open_shared(const char *name, int max, int slot_size)
+{
+    if (max < 1 || slot_size < 1)
+    {
+        ERROR("a shared mtq needs a positive size and slot size");
+    }
+    size_t len = sizeof(Shared) + (size_t)max * slot_size;
+    Shared *s;
+
+    for (;;)
+    {
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0)
+        {
+            if (ftruncate(fd, len))
+            {
+                ERROR("ftruncate() failed: %s", strerror(errno));
+            }
+            s = (Shared *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (s == MAP_FAILED)
+            {
+                ERROR("mmap() failed: %s", strerror(errno));
+            }
+            init(s, max, slot_size);
+            close(fd);
+            break;
+        }
+        if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0)
+        {
+            ERROR("shm_open(%s) failed: %s", name, strerror(errno));
+        }
+        s = attach(fd, name);
+        close(fd);
+        if (s->slot_size != (uint32_t)slot_size)
+        {
+            ERROR("%s: a shared mtq of %u-byte slots, not %d-byte", name, s->slot_size, slot_size);
+        }
+        len = sizeof(Shared) + (size_t)s->max * s->slot_size;
+        lock(s);
+        reap(s);
+        int over = done(s);
+        pthread_mutex_unlock(&s->lock);
+        if (!over)
+        {
+            break;
+        }
+        // left by a run that ended without removing it: start afresh
+        WARN("%s: a finished run's shared mtq; replacing it", name);
+        munmap(s, len);
+        shm_unlink(name);
+        len = sizeof(Shared) + (size_t)max * slot_size;
+    }
+
+    Srep rep = (Srep)malloc(sizeof(*rep));
+    if (!rep)
+    {
+        ERROR("Failed malloc for mtq");
+    }
+    rep->s = s;
+    rep->len = len;
+    rep->name = strdup(name);
+    rep->leaving = 0;
+    return rep;
+}
+
+/**
+ * Copies an item into the tail slot, waiting for room.
+ *
+ * @param mtq The queue.
+ * @param item slot_size bytes to copy.
+ * @return 1 if the item was put; 0 if this process is leaving.
+ */
+int mtq_shared_put(MtqShm mtq, const void *item)
+{
+    Srep rep = (Srep)mtq;
+    Shared *s = rep->s;
+    lock(s);
+    while (s->tail - s->head >= s->max && !rep->leaving)
+    {
+        waitfor(s, &s->consumed, 0);
+    }
+    if (rep->leaving)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    memcpy(s->slots + (s->tail % s->max) * s->slot_size, item, s->slot_size);
+    s->tail++;
+    bump(&s->produced, 0);
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+/**
+ * Copies the head item out of its slot, waiting for one, or for the run
+ * to be over.
+ *
+ * @param mtq The queue.
+ * @param item Where to copy slot_size bytes.
+ * @return 1 if an item was copied; 0 once every registered producer has
+ *         finished and the queue is empty, or if this process is leaving.
+ */
+int mtq_shared_get(MtqShm mtq, void *item)
+{
+    Srep rep = (Srep)mtq;
+    Shared *s = rep->s;
+    lock(s);
+    while (s->tail == s->head || rep->leaving)
+    {
+        if (done(s) || rep->leaving)
+        {
+            pthread_mutex_unlock(&s->lock);
+            return 0;
+        }
+        // a producer that dies never says it is finished, so look now and then
+        waitfor(s, &s->produced, REAP_MS);
+        reap(s);
+    }
+    memcpy(item, s->slots + (s->head % s->max) * s->slot_size, s->slot_size);
+    s->head++;
+    bump(&s->consumed, 0);
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+/**
+ * Registers this process as a producer, before it puts anything, so that
+ * consumers wait for it to finish, or to die.
+ *
+ * @param mtq The queue.
+ */
+void mtq_shared_register(MtqShm mtq)
+{
+    Shared *s = ((Srep)mtq)->s;
+    lock(s);
+    int i = 0;
+    while (i < PIDS && s->pids[i])
+    {
+        i++;
+    }
+    if (i == PIDS)
+    {
+        pthread_mutex_unlock(&s->lock);
+        ERROR("a shared mtq takes at most %d producer processes at once", PIDS);
+    }
+    s->pids[i] = getpid();
+    s->producers++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Marks a registered producer as done putting. Once every one is, and the
+ * queue is empty, gets return 0, so consumers are woken to see that.
+ *
+ * @param mtq The queue.
+ */
+void mtq_shared_finish(MtqShm mtq)
+{
+    Shared *s = ((Srep)mtq)->s;
+    pid_t pid = getpid();
+    lock(s);
+    for (int i = 0; i < PIDS; i++)
+    {
+        if (s->pids[i] == pid)
+        {
+            s->pids[i] = 0;
+        }
+    }
+    s->finished++;
+    bump(&s->produced, 1);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Returns the number of items in the queue, a snapshot taken under its lock.
+ *
+ * @param mtq The queue.
+ * @return The number of items.
+ */
+int mtq_shared_len(MtqShm mtq)
+{
+    Shared *s = ((Srep)mtq)->s;
+    lock(s);
+    int len = s->tail - s->head;
+    pthread_mutex_unlock(&s->lock);
+    return len;
+}
+
+/**
+ * Ends this process's waits, and its later puts and gets, as for a stop;
+ * the queue, and what is in it, is left to the other processes. The
+ * futex words are shared, so other processes' waiters are woken too, and
+ * wait again.
+ *
+ * @param mtq The queue.
+ */
+void mtq_shared_leave(MtqShm mtq)
+{
+    Srep rep = (Srep)mtq;
+    Shared *s = rep->s;
+    lock(s);
+    rep->leaving = 1;
+    bump(&s->produced, 1);
+    bump(&s->consumed, 1);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Unmaps this process's view of the queue. Processes still attached keep
+ * using it; once the name is unlinked, new ones create a fresh queue.
+ *
+ * @param mtq The queue.
+ * @param unlink Nonzero to remove the name.
+ */
+void mtq_shared_close(MtqShm mtq, int unlink)
+{
+    Srep rep = (Srep)mtq;
+    munmap(rep->s, rep->len);
+    if (unlink)
+    {
+        shm_unlink(rep->name);
+    }
+    free(rep->name);
+    free(rep);
+}
@@ -0,0 +1,30 @@
+#ifndef MTQSHM_H
+#define MTQSHM_H
+
+// A bounded mtq in POSIX shared memory, for producers and consumers in
+// separate processes on one host. Items are copied in and out of
+// fixed-size inline slots, since a pointer means nothing in another
+// process. The lock is a robust, process-shared mutex: if a process dies
+// holding it, the next locker recovers the queue, whose indices are only
+// ever advanced after a slot is complete. Waits are on futex words, not
+// condition variables, which a process dying as it waits can wedge.
+//
+// A run ends when every producer process that registered has finished
+// and the queue is empty: consumers' gets then return 0. Producers must
+// register before the first of them finishes. One that dies before it
+// finishes is counted finished once a waiting consumer sees its pid is
+// gone, within a tenth of a second. A queue left behind by a finished
+// run is replaced by the next process to open it.
+
+typedef void *MtqShm;
+
+MtqShm mtq_open_shared(const char *name, int max, int slot_size); // creates, or attaches
+int mtq_shared_put(MtqShm, const void *item);  // blocks for room; 0 once leaving
+int mtq_shared_get(MtqShm, void *item);        // blocks for an item; 0 once the run is over, or leaving
+void mtq_shared_register(MtqShm);              // a producer process, before its first put
+void mtq_shared_finish(MtqShm);                // a producer process, after its last put
+void mtq_shared_leave(MtqShm);                 // this process's puts and gets return 0, as for a stop
+int mtq_shared_len(MtqShm);
+void mtq_shared_close(MtqShm, int unlink);     // unlink: remove the name, too
+
+#endif
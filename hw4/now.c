@@ -0,0 +1,41 @@
+#include <errno.h>
+#include <time.h>
+
+#include "now.h"
+#include "vclock.h"
+
+/* Returns CLOCK_MONOTONIC, or virtual time in a simulation, in ns */
+extern uint64_t now_ns() {
+  if (vclock_running())
+    return vclock_now();
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Sleeps until now_ns() reaches ns; returns at once if it has */
+extern void sleep_until(uint64_t ns) {
+  if (vclock_sleep_until(ns))
+    return;
+  struct timespec t = {ns / 1000000000, ns % 1000000000};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0) == EINTR)
+    ;
+}
+
+/* Sleeps for ns */
+extern void sleep_ns(uint64_t ns) {
+  sleep_until(now_ns() + ns);
+}
+
+/**
+ * Sleeps until now_ns() reaches ns, or *flag is set, whichever is first,
+ * looking at the flag each 100 ms.
+ *
+ * @return nonzero if the flag was set.
+ */
+extern int nap_until(uint64_t ns, const int *flag) {
+  uint64_t now;
+  while (!__atomic_load_n(flag, __ATOMIC_ACQUIRE) && (now = now_ns()) < ns)
+    sleep_until(ns < now + 100000000 ? ns : now + 100000000);
+  return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,17 @@
+#ifndef NOW_H
+#define NOW_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+
+// Monotonic time in nanoseconds, and sleeping until or for a time, or,
+// napping, until a flag is set. In a simulation (vclock.h), both are
+// virtual.
+
+extern LINKAGE uint64_t now_ns();
+extern LINKAGE void     sleep_until(uint64_t ns);
+extern LINKAGE void     sleep_ns(uint64_t ns);
+extern LINKAGE int      nap_until(uint64_t ns, const int *flag); // nonzero if the flag was set
+
+#endif
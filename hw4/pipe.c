@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe.h"
+#include "mtq.h"
+#include "threads.h"
+#include "now.h"
+#include "error.h"
+
+#define STAGES 16
+
+// One stage, its input queue, and its counters
+typedef struct {
+  const char *name;
+  PipeF f;
+  void *arg;
+  int threads, batch;
+  Mtq in;              // 0 for the source
+  int live;            // threads still running
+  int next;            // thread numbering
+  uint64_t items;      // items processed
+  uint64_t busy;       // ns spent in f
+  uint64_t depth_sum;  // input depth, summed over samples
+  int depth_max;
+} Stage;
+
+// Representation of a Pipe
+typedef struct {
+  int n;
+  int qmax;
+  long left;           // items the source has still to make
+  int done;
+  uint64_t start;
+  uint64_t samples;
+  Stage s[STAGES];
+} *Rep;
+
+// What each worker thread is given
+typedef struct {
+  Rep r;
+  int i; // stage index
+} Work;
+
+static Rep rep(Pipe p) {
+  if (!p) ERROR("zero pointer");
+  return (Rep)p;
+}
+
+/**
+ * Creates an empty pipeline.
+ *
+ * @param qmax the capacity of each queue between stages (0 = unbounded).
+ *
+ * @return the new pipeline.
+ */
+extern Pipe pipe_new(int qmax) {
+  Rep r = (Rep)calloc(1, sizeof(*r));
+  if (!r) ERROR("calloc() failed");
+  r->qmax = qmax;
+  return r;
+}
+
+/**
+ * Appends a stage to the pipeline.
+ *
+ * @param name    for reports.
+ * @param f       the stage function.
+ * @param arg     passed to every call of f.
+ * @param threads threads running the stage.
+ * @param batch   most items a thread takes from its input queue at once.
+ */
+extern void pipe_stage(Pipe p, const char *name, PipeF f, void *arg, int threads, int batch) {
+  Rep r = rep(p);
+  if (r->n == STAGES) ERROR("too many stages");
+  if (threads < 1 || batch < 1) ERROR("%s: need threads >= 1 and batch >= 1", name);
+  Stage *s = &r->s[r->n];
+  memset(s, 0, sizeof(*s));
+  s->name = name;
+  s->f = f;
+  s->arg = arg;
+  s->threads = threads;
+  s->batch = batch;
+  s->in = r->n ? mtq_new(r->qmax) : 0;
+  r->n++;
+}
+
+/**
+ * Applies a stage to a batch and passes the results on.
+ */
+static void apply(Rep r, int i, Data *d, int n) {
+  Stage *s = &r->s[i];
+  int out = 0;
+  uint64_t t = now_ns();
+  for (int k = 0; k < n; k++) {
+    Data x = s->f(d[k], s->arg);
+    if (x)
+      d[out++] = x;
+  }
+  __atomic_add_fetch(&s->busy, now_ns() - t, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->items, n, __ATOMIC_RELAXED);
+  if (i + 1 < r->n && out)
+    mtq_tail_putn(r->s[i + 1].in, d, out);
+}
+
+/**
+ * Stage thread: runs batches until its input is exhausted. The stage's
+ * last thread to finish sends one 0 per thread of the next stage.
+ */
+static void *work(void *a) {
+  Work *w = a;
+  Rep r = w->r;
+  Stage *s = &r->s[w->i];
+  Data *d = malloc(sizeof(*d) * s->batch);
+  if (!d) ERROR("malloc() failed");
+
+  for (int end = 0; !end;) {
+    int n = 0;
+    if (!s->in) {
+      // the source claims its share of the remaining items
+      while (n < s->batch && __atomic_sub_fetch(&r->left, 1, __ATOMIC_RELAXED) >= 0)
+        d[n++] = 0;
+      end = n < s->batch;
+    } else {
+      n = mtq_head_getn(s->in, d, s->batch);
+      if (!d[n - 1]) {
+        end = 1;
+        n--;
+      }
+    }
+    if (n)
+      apply(r, w->i, d, n);
+  }
+
+  if (!__atomic_sub_fetch(&s->live, 1, __ATOMIC_ACQ_REL) && w->i + 1 < r->n) {
+    Stage *next = &r->s[w->i + 1];
+    for (int k = 0; k < next->threads; k++)
+      mtq_tail_put_wait(next->in, 0);
+  }
+  free(d);
+  return 0;
+}
+
+static void report(Rep r, const char *when) {
+  double secs = (now_ns() - r->start) / 1e9;
+  log_msg(2, "pipe: %s t=%.1fs", when, secs);
+  for (int i = 0; i < r->n; i++) {
+    Stage *s = &r->s[i];
+    uint64_t items = __atomic_load_n(&s->items, __ATOMIC_RELAXED);
+    uint64_t busy = __atomic_load_n(&s->busy, __ATOMIC_RELAXED);
+    log_msg(2, "  %-8s threads=%d batch=%d items=%lu rate=%.1f/s util=%.0f%% depth=%d mean=%.1f max=%d",
+            s->name, s->threads, s->batch, (unsigned long)items, items / secs,
+            100.0 * busy / 1e9 / secs / s->threads, s->in ? mtq_len(s->in) : 0,
+            r->samples ? (double)s->depth_sum / r->samples : 0, s->depth_max);
+  }
+}
+
+/**
+ * Runs the pipeline until the source has made every item and the last
+ * stage has processed it, sampling queue depths every 10 ms.
+ *
+ * @param items     the number of items the source makes.
+ * @param report_ms interval between progress reports, 0 for none.
+ */
+extern void pipe_run(Pipe p, long items, int report_ms) {
+  Rep r = rep(p);
+  if (!r->n) ERROR("empty pipeline");
+  r->left = items;
+  r->start = now_ns();
+
+  Work w[STAGES];
+  pthread_t **t[STAGES];
+  for (int i = 0; i < r->n; i++) {
+    w[i].r = r;
+    w[i].i = i;
+    r->s[i].live = r->s[i].threads;
+  }
+  for (int i = 0; i < r->n; i++)
+    t[i] = create_threads(work, r->s[i].threads, &w[i]);
+
+  // sample depths until the last stage's threads are done
+  uint64_t next = report_ms ? r->start + report_ms * 1000000ULL : 0;
+  while (__atomic_load_n(&r->s[r->n - 1].live, __ATOMIC_ACQUIRE)) {
+    sleep_ns(10000000);
+    for (int i = 1; i < r->n; i++) {
+      int d = mtq_len(r->s[i].in);
+      r->s[i].depth_sum += d;
+      if (d > r->s[i].depth_max)
+        r->s[i].depth_max = d;
+    }
+    r->samples++;
+    if (next && now_ns() >= next) {
+      report(r, "progress");
+      next += report_ms * 1000000ULL;
+    }
+  }
+
+  for (int i = 0; i < r->n; i++)
+    wait_threads(t[i], r->s[i].threads);
+  report(r, "done");
+}
+
+/**
+ * Makes the source stop making items; those already made run through the
+ * remaining stages, and pipe_run returns once they have.
+ */
+extern void pipe_stop(Pipe p) {
+  __atomic_store_n(&rep(p)->left, 0, __ATOMIC_RELAXED);
+}
+
+/* Frees a pipeline and its queues, which pipe_run has emptied */
+extern void pipe_free(Pipe p) {
+  Rep r = rep(p);
+  for (int i = 1; i < r->n; i++)
+    mtq_del(r->s[i].in, 0);
+  free(r);
+}
@@ -0,0 +1,22 @@
+#ifndef PIPE_H
+#define PIPE_H
+
+#include "deq.h"
+
+// A pipeline of stages with an Mtq between each pair. Each stage has its
+// own threads and batch size: a thread takes up to batch items from its
+// input queue at once, applies the stage function to each, and passes
+// the results to the next stage. The first stage is a source, called
+// with 0 once per item; the last stage's results are discarded.
+// pipe_run reports each stage's throughput, utilization, and input depth.
+
+typedef void *Pipe;
+typedef Data (*PipeF)(Data d, void *arg); // returns the item for the next stage, or 0 to drop it
+
+extern Pipe pipe_new(int qmax);
+extern void pipe_stage(Pipe p, const char *name, PipeF f, void *arg, int threads, int batch);
+extern void pipe_run(Pipe p, long items, int report_ms);
+extern void pipe_stop(Pipe p); // from another thread: the source makes no more
+extern void pipe_free(Pipe p);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "prof.h"
+#include "error.h"
+
+#ifdef PROF
+
+#define SITES   256 // call sites; later ones are not counted
+#define BUCKETS 48  // log2 cycles
+
+// One site's counts, in one thread
+typedef struct {
+  uint64_t calls, cycles, max;
+  uint64_t bucket[BUCKETS]; // bucket b: cycles in [2^b, 2^(b+1))
+} Count;
+
+// One thread's counts. Only its thread writes them, with relaxed stores,
+// so a report may read them at any time.
+typedef struct Table {
+  struct Table *next;
+  pid_t tid;
+  Count c[SITES];
+} *Table;
+
+static __thread Table mine;
+
+static struct {
+  pthread_mutex_t lock; // guards sites and tables
+  ProfSite *sites[SITES];
+  int nsites;
+  Table tables;         // every thread's, kept after it exits
+  uint64_t ns, cycles;  // both clocks, read together at prof_start()
+} prof = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Real time, even in a simulation, to calibrate cycles against
+static uint64_t wall() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static Table newtable() {
+  // touch every page now, rather than fault inside later scopes
+  Table t = (Table)malloc(sizeof(*t));
+  if (!t) ERROR("malloc() failed");
+  memset(t, 0, sizeof(*t));
+  t->tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&prof.lock);
+  t->next = prof.tables;
+  prof.tables = t;
+  pthread_mutex_unlock(&prof.lock);
+  return t;
+}
+
+/* Registers a site on its first entry */
+extern __attribute__((noinline)) void prof_enter(ProfSite *s) {
+  pthread_mutex_lock(&prof.lock);
+  if (!s->id && prof.nsites < SITES) {
+    prof.sites[prof.nsites++] = s;
+    __atomic_store_n(&s->id, prof.nsites, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&prof.lock);
+}
+
+#define ADD(F, V) __atomic_store_n(&(F), (F) + (V), __ATOMIC_RELAXED)
+
+/* Ends a scope: the cleanup of a PROF_SCOPE */
+extern __attribute__((noinline)) void prof_end(ProfSpan *p) {
+  uint64_t dt = prof_cycles() - p->t0;
+  ProfSite *s = p->site;
+  if (!s->id)
+    return; // past SITES
+  Table t = mine;
+  if (!t)
+    t = mine = newtable();
+  Count *c = &t->c[s->id - 1];
+  int b = dt ? 63 - __builtin_clzll(dt) : 0;
+  ADD(c->calls, 1);
+  ADD(c->cycles, dt);
+  ADD(c->bucket[b < BUCKETS ? b : BUCKETS - 1], 1);
+  if (dt > c->max)
+    __atomic_store_n(&c->max, dt, __ATOMIC_RELAXED);
+}
+
+// A percentile's bucket, as its upper bound in cycles
+static uint64_t pct(uint64_t *bucket, uint64_t calls, double p) {
+  uint64_t want = calls * p / 100, n = 0;
+  for (int b = 0; b < BUCKETS; b++)
+    if ((n += bucket[b]) > want)
+      return 2ULL << b;
+  return 2ULL << (BUCKETS - 1);
+}
+
+static void line(int fd, const char *what, Count *c, uint64_t all, double rate) {
+  dprintf(fd, "%-36s %10lu %14lu %5.1f%% %9.0f %9.0f %9lu %9lu %9lu %11.0f\n",
+          what, (unsigned long)c->calls, (unsigned long)c->cycles,
+          all ? 100.0 * c->cycles / all : 0, (double)c->cycles / c->calls,
+          (double)c->cycles / c->calls * rate, (unsigned long)pct(c->bucket, c->calls, 50),
+          (unsigned long)pct(c->bucket, c->calls, 99), (unsigned long)c->max, c->max * rate);
+}
+
+/**
+ * Writes cycles per call site, busiest first, each followed by its
+ * per-thread breakdown. Percentiles are log2 bucket upper bounds.
+ *
+ * @param fd where to write.
+ */
+extern void prof_report(int fd) {
+  double rate = 1; // ns per cycle
+  uint64_t cycles = prof_cycles() - prof.cycles;
+  if (prof.cycles && cycles)
+    rate = (double)(wall() - prof.ns) / cycles;
+
+  pthread_mutex_lock(&prof.lock);
+  static Count sum[SITES];
+  static int order[SITES];
+  uint64_t all = 0;
+  memset(sum, 0, sizeof(sum));
+  for (Table t = prof.tables; t; t = t->next)
+    for (int i = 0; i < prof.nsites; i++) {
+      Count *c = &t->c[i];
+      sum[i].calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+      sum[i].cycles += __atomic_load_n(&c->cycles, __ATOMIC_RELAXED);
+      uint64_t max = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+      if (max > sum[i].max)
+        sum[i].max = max;
+      for (int b = 0; b < BUCKETS; b++)
+        sum[i].bucket[b] += __atomic_load_n(&c->bucket[b], __ATOMIC_RELAXED);
+    }
+  for (int i = 0; i < prof.nsites; i++) {
+    all += sum[i].cycles;
+    int j = i;
+    for (; j > 0 && sum[order[j - 1]].cycles < sum[i].cycles; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  dprintf(fd, "prof: %.3f ns/cycle; scopes nest, so shares may sum past 100%%\n", rate);
+  dprintf(fd, "%-36s %10s %14s %6s %9s %9s %9s %9s %9s %11s\n", "site / thread", "calls", "cycles",
+          "share", "mean", "mean-ns", "p50", "p99", "max", "max-ns");
+  for (int k = 0; k < prof.nsites; k++) {
+    int i = order[k];
+    if (!sum[i].calls)
+      continue;
+    ProfSite *s = prof.sites[i];
+    char what[64];
+    snprintf(what, sizeof(what), "%s (%s:%d)", s->name, s->file, s->line);
+    line(fd, what, &sum[i], all, rate);
+    for (Table t = prof.tables; t; t = t->next) {
+      Count c = t->c[i];
+      if (!c.calls)
+        continue;
+      snprintf(what, sizeof(what), "  tid %d", t->tid);
+      line(fd, what, &c, all, rate);
+    }
+  }
+  pthread_mutex_unlock(&prof.lock);
+}
+
+static void finish() {
+  prof_report(2);
+}
+
+/**
+ * Starts profiling: calibrates cycles against time, and arranges for a
+ * report on stderr at exit.
+ */
+extern void prof_start() {
+  prof.ns = wall();
+  prof.cycles = prof_cycles();
+  atexit(finish);
+}
+
+#else
+
+extern void prof_start() {}
+extern void prof_report(int fd) {}
+
+#endif
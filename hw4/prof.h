@@ -0,0 +1,69 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+
+// Cycle counts per call site, for attributing CPU time in the hot paths
+// without an external profiler. Build with -DPROF (make PROF=1) to count
+// them; otherwise PROF_SCOPE compiles away. A scope reads the cycle
+// counter with rdtscp at entry and exit and adds the difference to its
+// thread's log2 histogram for that site: no lock, no allocation after
+// the thread's first scope. prof_start() arranges for a report, per site
+// and per thread, at exit.
+
+#ifdef PROF
+
+// A call site: one static per PROF_SCOPE
+typedef struct {
+  const char *name, *file;
+  int line;
+  int id;        // 1.., once registered
+} ProfSite;
+
+typedef struct {
+  ProfSite *site;
+  uint64_t t0;   // cycles
+} ProfSpan;
+
+static inline uint64_t prof_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned aux;
+  return __builtin_ia32_rdtscp(&aux);
+#else
+  return 0;
+#endif
+}
+
+extern LINKAGE void prof_enter(ProfSite *s);
+extern LINKAGE void prof_end(ProfSpan *s);
+
+#define PROF_CAT2(A,B) A##B
+#define PROF_CAT(A,B) PROF_CAT2(A,B)
+#define PROF_SITE(name) \
+  static ProfSite PROF_CAT(_site,__LINE__)={name,__FILE__,__LINE__,0}; \
+  if (!__atomic_load_n(&PROF_CAT(_site,__LINE__).id,__ATOMIC_ACQUIRE)) prof_enter(&PROF_CAT(_site,__LINE__))
+
+#ifdef __cplusplus
+struct ProfScope {
+  ProfSpan s;
+  __attribute__((always_inline)) ProfScope(ProfSite *site) { s.site=site; s.t0=prof_cycles(); }
+  __attribute__((always_inline)) ~ProfScope() { prof_end(&s); }
+};
+#define PROF_SCOPE(name) \
+  PROF_SITE(name); ProfScope PROF_CAT(_prof,__LINE__)(&PROF_CAT(_site,__LINE__))
+#else
+#define PROF_SCOPE(name) \
+  PROF_SITE(name); \
+  ProfSpan PROF_CAT(_prof,__LINE__) __attribute__((cleanup(prof_end))) = {&PROF_CAT(_site,__LINE__), prof_cycles()}
+#endif
+
+#else
+#define PROF_SCOPE(name) do {} while (0)
+#endif
+
+extern LINKAGE void prof_start();
+extern LINKAGE void prof_report(int fd);
+
+#endif
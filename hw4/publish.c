@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "publish.h"
+#include "shmring.h"
+#include "now.h"
+#include "error.h"
+#include "mem.h"
+
+#define SLOTS (1 << 16) // ring events
+
+typedef struct {
+  int lawnsize, molesize;
+  uint8_t *cells;  // RasterState per cell, set by workers
+  uint8_t *shown;  // what the viewer has been sent
+  ShmRing ring;
+  int stop;
+} *Rep;
+
+static Rep rep(Publish p) {
+  if (!p) ERROR("zero pointer");
+  return (Rep)p;
+}
+
+/**
+ * Creates the shared-memory ring a viewer attaches to.
+ *
+ * @param name the shared-memory name, e.g. "/wam-lawn".
+ * @param lawnsize moles per side.
+ * @param molesize pixels per mole side.
+ *
+ * @return the publisher.
+ */
+extern Publish publish_new(const char *name, int lawnsize, int molesize) {
+  Rep p = (Rep)calloc(1, sizeof(*p));
+  if (!p) ERROR("calloc() failed");
+  p->lawnsize = lawnsize;
+  p->molesize = molesize;
+  p->cells = (uint8_t *)calloc(2, lawnsize * lawnsize);
+  if (!p->cells) ERROR("calloc() failed");
+  mem_add(MemWidgets, sizeof(*p) + 2 * lawnsize * lawnsize);
+  p->shown = p->cells + lawnsize * lawnsize;
+  p->ring = shmring_create(name, lawnsize, molesize, SLOTS);
+  return p;
+}
+
+/* Sets the state of the mole covering pixel (x,y) */
+extern void publish_set(Publish pub, int x, int y, RasterState s) {
+  Rep p = rep(pub);
+  int cx = x / p->molesize, cy = y / p->molesize;
+  if (cx < 0 || cy < 0 || cx >= p->lawnsize || cy >= p->lawnsize)
+    return;
+  __atomic_store_n(&p->cells[cy * p->lawnsize + cx], (uint8_t)s, __ATOMIC_RELAXED);
+}
+
+/* Pushes each changed cell; returns 0 if the ring filled first */
+static int diff(Rep p) {
+  int n = p->lawnsize * p->lawnsize;
+  for (int i = 0; i < n; i++) {
+    uint8_t s = __atomic_load_n(&p->cells[i], __ATOMIC_RELAXED);
+    if (s == p->shown[i])
+      continue;
+    if (!shmring_push(p->ring, SHMRING_EVENT(i, s)))
+      return 0;
+    p->shown[i] = s;
+  }
+  return 1;
+}
+
+/**
+ * Publishes changes each period until publish_stop, then publishes the
+ * last ones, if the ring has room, and closes the ring.
+ *
+ * @param pub the publisher.
+ * @param period_ms the period.
+ */
+extern void publish_run(Publish pub, int period_ms) {
+  Rep p = rep(pub);
+  uint64_t period = (period_ms > 0 ? period_ms : 16) * 1000000ULL;
+  uint64_t next = now_ns();
+  long full = 0;
+  for (int last = 0; !last;) {
+    last = __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+    full += !diff(p);
+    next += period;
+    if (next < now_ns())
+      next = now_ns();
+    else if (!last)
+      sleep_until(next);
+  }
+  shmring_close(p->ring);
+  if (full)
+    log_msg(2, "publish: ring full for %ld periods; is a viewer attached?", full);
+}
+
+/* Makes publish_run return after one more period */
+extern void publish_stop(Publish p) {
+  __atomic_store_n(&rep(p)->stop, 1, __ATOMIC_RELEASE);
+}
+
+extern void publish_free(Publish pub) {
+  Rep p = rep(pub);
+  shmring_free(p->ring);
+  mem_add(MemWidgets, -(long)(sizeof(*p) + 2 * p->lawnsize * p->lawnsize));
+  free(p->cells);
+  free(p);
+}
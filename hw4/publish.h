@@ -0,0 +1,22 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include "linkage.h"
+#include "raster.h"
+
+// The lawn, published to a viewer process through a shared-memory ring
+// (shmring.h). Workers only store each cell's state, as for a raster;
+// publish_run's thread diffs the cells against what it last published,
+// each period, and pushes the changes. So a slow or absent viewer costs
+// the workers nothing: when the ring is full, changes wait for the next
+// period, and a cell that changed twice meanwhile is sent once.
+
+typedef void *Publish;
+
+extern LINKAGE Publish publish_new(const char *name, int lawnsize, int molesize);
+extern LINKAGE void    publish_set(Publish p, int x, int y, RasterState s);
+extern LINKAGE void    publish_run(Publish p, int period_ms); // until publish_stop
+extern LINKAGE void    publish_stop(Publish p);
+extern LINKAGE void    publish_free(Publish p);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "raster.h"
+#include "metrics.h"
+#include "now.h"
+#include "error.h"
+#include "mem.h"
+
+// eight pixels, stored with one or two vector instructions
+typedef uint32_t V8 __attribute__((vector_size(32)));
+
+#define RGBA(R,G,B) ((uint32_t)(R) | (uint32_t)(G) << 8 | (uint32_t)(B) << 16 | 0xffu << 24)
+
+static const uint32_t colors[] = {
+  [RasterNone]  = RGBA(0x8b, 0x6b, 0x3d), // soil
+  [RasterGreen] = RGBA(0x00, 0xc0, 0x00),
+  [RasterRed]   = RGBA(0xe0, 0x00, 0x00),
+};
+
+typedef struct {
+  int lawnsize, molesize;
+  int size;           // pixels per side
+  uint8_t *cells;     // RasterState per cell
+  uint32_t *fb;       // size*size pixels, RGBA in memory order
+  int *x0, *x1;       // the circle's span on each of its rows
+  int stop;
+} *Rep;
+
+static Rep rep(Raster r) {
+  if (!r) ERROR("zero pointer");
+  return (Rep)r;
+}
+
+// what a raster has allocated, for mem.c
+static long bytes(Rep r) {
+  return sizeof(*r) + r->lawnsize * r->lawnsize + (long)r->size * r->size * sizeof(uint32_t)
+    + 2 * r->molesize * sizeof(int);
+}
+
+/**
+ * Creates a lawn's framebuffer, cleared to soil.
+ *
+ * @param lawnsize moles per side.
+ * @param molesize pixels per mole side.
+ *
+ * @return the raster.
+ */
+extern Raster raster_new(int lawnsize, int molesize) {
+  Rep r = (Rep)calloc(1, sizeof(*r));
+  if (!r) ERROR("calloc() failed");
+  r->lawnsize = lawnsize;
+  r->molesize = molesize;
+  r->size = lawnsize * molesize;
+  r->cells = (uint8_t *)calloc(lawnsize * lawnsize, 1);
+  r->fb = (uint32_t *)malloc((size_t)r->size * r->size * sizeof(uint32_t));
+  r->x0 = (int *)malloc(2 * molesize * sizeof(int));
+  if (!r->cells || !r->fb || !r->x0) ERROR("malloc() failed");
+  mem_add(MemWidgets, bytes(r));
+  r->x1 = r->x0 + molesize;
+
+  // row j of a circle inscribed in the cell covers pixels x0[j] to x1[j]-1
+  double c = molesize / 2.0;
+  for (int j = 0; j < molesize; j++) {
+    double dy = j + 0.5 - c;
+    double hw = sqrt(c * c - dy * dy);
+    r->x0[j] = (int)lround(c - hw);
+    r->x1[j] = (int)lround(c + hw);
+  }
+  raster_render(r);
+  return r;
+}
+
+/* Sets the state of the mole covering pixel (x,y) */
+extern void raster_set(Raster r, int x, int y, RasterState s) {
+  Rep p = rep(r);
+  int cx = x / p->molesize, cy = y / p->molesize;
+  if (cx < 0 || cy < 0 || cx >= p->lawnsize || cy >= p->lawnsize)
+    return;
+  __atomic_store_n(&p->cells[cy * p->lawnsize + cx], (uint8_t)s, __ATOMIC_RELAXED);
+}
+
+/* Fills n pixels at p with one color, eight at a time */
+static void span(uint32_t *p, int n, uint32_t color) {
+  V8 v = (V8){0} + color;
+  for (; n >= 8; n -= 8, p += 8)
+    memcpy(p, &v, sizeof(v));
+  for (; n > 0; n--)
+    *p++ = color;
+}
+
+/**
+ * Draws one frame: soil, then a circle for each cell with a mole.
+ *
+ * @param r the raster.
+ */
+extern void raster_render(Raster r) {
+  Rep p = rep(r);
+  uint64_t t0 = now_ns();
+  int ms = p->molesize;
+  for (int y = 0; y < p->size; y++)
+    span(p->fb + (size_t)y * p->size, p->size, colors[RasterNone]);
+  for (int cy = 0; cy < p->lawnsize; cy++)
+    for (int cx = 0; cx < p->lawnsize; cx++) {
+      int s = __atomic_load_n(&p->cells[cy * p->lawnsize + cx], __ATOMIC_RELAXED);
+      if (!s)
+        continue;
+      uint32_t *o = p->fb + (size_t)cy * ms * p->size + cx * ms;
+      for (int j = 0; j < ms; j++, o += p->size)
+        span(o + p->x0[j], p->x1[j] - p->x0[j], colors[s]);
+    }
+  OBSERVE("wam_raster_frame_seconds", "time to render one raster frame", now_ns() - t0);
+}
+
+/* Writes the current frame as a binary PPM image */
+extern void raster_ppm(Raster r, const char *path) {
+  Rep p = rep(r);
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    WARN("cannot write %s", path);
+    return;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", p->size, p->size);
+  uint8_t *row = (uint8_t *)malloc(3 * p->size);
+  if (!row) ERROR("malloc() failed");
+  for (int y = 0; y < p->size; y++) {
+    uint8_t *px = (uint8_t *)(p->fb + (size_t)y * p->size);
+    for (int x = 0; x < p->size; x++)
+      memcpy(row + 3 * x, px + 4 * x, 3);
+    fwrite(row, 3, p->size, f);
+  }
+  free(row);
+  fclose(f);
+}
+
+/*
+ * Returns whether a frame path is a pattern for one PPM per frame: it has
+ * exactly one %d, with an optional 0 and width, and may have %% too. A
+ * path with no conversion is raw video; any other conversion is an error,
+ * as the path is used as a format.
+ */
+static int pattern(const char *frames) {
+  int d = 0, other = 0;
+  for (const char *s = frames; (s = strchr(s, '%')); s++) {
+    if (s[1] == '%') {
+      s++;
+      continue;
+    }
+    s++;
+    if (*s == '0')
+      s++;
+    for (int w = 0; *s >= '0' && *s <= '9' && w < 2; w++)
+      s++;
+    if (*s == 'd')
+      d++;
+    else
+      other++;
+    if (!*s)
+      break;
+  }
+  if (other || d > 1)
+    ERROR("frames: %s: want one %%d, as in frame%%05d.ppm, or none", frames);
+  return d;
+}
+
+/**
+ * Renders a frame each period until raster_stop, then renders a last one.
+ * A frame path containing %d (e.g. frame%05d.ppm) gets one PPM per frame;
+ * any other path gets raw RGBA video, e.g. for
+ * ffmpeg -f rawvideo -pix_fmt rgba -s SIZExSIZE -r 60 -i PATH out.mp4.
+ * Render times are reported when it stops.
+ *
+ * @param r the raster.
+ * @param frames where to write frames; 0 or "" to write none.
+ * @param frame_ms the period.
+ */
+extern void raster_run(Raster r, const char *frames, int frame_ms) {
+  Rep p = rep(r);
+  int ppm = frames && pattern(frames);
+  FILE *raw = 0;
+  if (frames && *frames && !ppm && !(raw = fopen(frames, "w")))
+    ERROR("cannot write %s", frames);
+
+  uint64_t period = (frame_ms > 0 ? frame_ms : 16) * 1000000ULL;
+  uint64_t next = now_ns(), busy = 0, most = 0;
+  long n = 0;
+  for (int last = 0; !last; n++) {
+    last = __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+    uint64_t t0 = now_ns();
+    raster_render(r);
+    uint64_t t = now_ns() - t0;
+    busy += t;
+    most = t > most ? t : most;
+    if (ppm) {
+      char path[4096];
+      snprintf(path, sizeof(path), frames, (int)n);
+      raster_ppm(r, path);
+    } else if (raw)
+      fwrite(p->fb, sizeof(uint32_t), (size_t)p->size * p->size, raw);
+    // a late frame is not made up: the next starts a period from now
+    next += period;
+    if (next < now_ns())
+      next = now_ns();
+    else if (!last)
+      sleep_until(next);
+  }
+  if (raw)
+    fclose(raw);
+  log_msg(2, "raster: %dx%d, %ld frames, render mean %.3f ms, max %.3f ms",
+          p->size, p->size, n, busy / 1e6 / n, most / 1e6);
+}
+
+/* Makes raster_run return after one more frame */
+extern void raster_stop(Raster r) {
+  __atomic_store_n(&rep(r)->stop, 1, __ATOMIC_RELEASE);
+}
+
+extern void raster_free(Raster r) {
+  Rep p = rep(r);
+  mem_add(MemWidgets, -bytes(p));
+  free(p->cells);
+  free(p->fb);
+  free(p->x0);
+  free(p);
+}
@@ -0,0 +1,25 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "linkage.h"
+
+// A headless lawn: moles are drawn as filled circles into an RGBA
+// framebuffer, one frame per period, by raster_run's thread. Each cell
+// of the lawn holds at most one mole's state, so setting it is a byte
+// store, and a frame costs one pass over the cells. Frames can be
+// written as PPM images (a path with %d gets one file per frame) or as
+// raw RGBA video (any other path; see raster_run).
+
+typedef void *Raster;
+
+typedef enum {RasterNone, RasterGreen, RasterRed} RasterState;
+
+extern LINKAGE Raster raster_new(int lawnsize, int molesize);
+extern LINKAGE void   raster_set(Raster r, int x, int y, RasterState s);
+extern LINKAGE void   raster_render(Raster r);
+extern LINKAGE void   raster_ppm(Raster r, const char *path);
+extern LINKAGE void   raster_run(Raster r, const char *frames, int frame_ms); // until raster_stop
+extern LINKAGE void   raster_stop(Raster r);
+extern LINKAGE void   raster_free(Raster r);
+
+#endif
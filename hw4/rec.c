@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "rec.h"
+#include "error.h"
+#include "now.h"
+#include "vclock.h"
+
+#define RECBUF 256 // records buffered per thread before a flush
+
+// A thread's private buffer; listed so rec_close can flush stragglers
+typedef struct Buf {
+  struct Buf *next;
+  int n;
+  RecRec r[RECBUF];
+} *Buf;
+
+// Recorder state: one per process
+static struct {
+  int on;
+  int fd;
+  RecHdr *hdr;          // start of the mapping
+  RecRec *recs;         // slots following the header
+  long max;             // slots in the file
+  long reserved;        // slots handed out; may exceed max
+  uint64_t t0;          // now_ns() at open
+  pthread_key_t key;
+  pthread_mutex_t lock; // guards bufs, not the records
+  Buf bufs;
+} rec = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t elapsed() {
+  return now_ns() - rec.t0;
+}
+
+/**
+ * Copies a buffer into the mapped file. The slot range is reserved with a
+ * single atomic add, so concurrent flushes never overlap or lock.
+ * Records that do not fit are counted as dropped.
+ */
+static void flush(Buf b) {
+  if (!b->n)
+    return;
+  long at = __atomic_fetch_add(&rec.reserved, b->n, __ATOMIC_RELAXED);
+  long fit = at >= rec.max ? 0 : (at + b->n <= rec.max ? b->n : rec.max - at);
+  if (fit)
+    memcpy(&rec.recs[at], b->r, fit * sizeof(RecRec));
+  if (fit < b->n)
+    __atomic_add_fetch(&rec.hdr->dropped, b->n - fit, __ATOMIC_RELAXED);
+  b->n = 0;
+}
+
+static void unlink_buf(Buf b) {
+  pthread_mutex_lock(&rec.lock);
+  for (Buf *p = &rec.bufs; *p; p = &(*p)->next)
+    if (*p == b) {
+      *p = b->next;
+      break;
+    }
+  pthread_mutex_unlock(&rec.lock);
+}
+
+/* Thread-exit destructor: flush and release the thread's buffer */
+static void retire(void *v) {
+  Buf b = (Buf)v;
+  flush(b);
+  unlink_buf(b);
+  free(b);
+}
+
+static Buf mybuf() {
+  Buf b = (Buf)pthread_getspecific(rec.key);
+  if (b)
+    return b;
+  b = (Buf)malloc(sizeof(*b));
+  if (!b) ERROR("malloc() failed");
+  b->n = 0;
+  pthread_mutex_lock(&rec.lock);
+  b->next = rec.bufs;
+  rec.bufs = b;
+  pthread_mutex_unlock(&rec.lock);
+  pthread_setspecific(rec.key, b);
+  return b;
+}
+
+/**
+ * Starts recording into a file, replacing any existing one.
+ *
+ * @param path     file to create.
+ * @param max      capacity in records; the file is truncated to its use at close.
+ * @param lawnsize recorded so a replay can size its lawn.
+ * @param molesize recorded so a replay can size its lawn.
+ */
+extern void rec_open(const char *path, long max, int lawnsize, int molesize) {
+  if (max <= 0) ERROR("bad record capacity: %ld", max);
+  rec.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (rec.fd < 0) ERROR("open(%s) failed: %s", path, strerror(errno));
+  size_t len = sizeof(RecHdr) + max * sizeof(RecRec);
+  if (ftruncate(rec.fd, len)) ERROR("ftruncate() failed: %s", strerror(errno));
+  void *m = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, rec.fd, 0);
+  if (m == MAP_FAILED) ERROR("mmap() failed: %s", strerror(errno));
+
+  rec.hdr = (RecHdr *)m;
+  rec.recs = (RecRec *)(rec.hdr + 1);
+  rec.max = max;
+  rec.reserved = 0;
+  rec.hdr->magic = REC_MAGIC;
+  rec.hdr->version = REC_VERSION;
+  rec.hdr->lawnsize = lawnsize;
+  rec.hdr->molesize = molesize;
+  if (pthread_key_create(&rec.key, retire)) ERROR("pthread_key_create() failed");
+  rec.t0 = now_ns();
+  __atomic_store_n(&rec.on, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Appends one event to the calling thread's buffer. A no-op unless
+ * recording; never takes a lock except on a thread's first event.
+ */
+extern void rec_event(RecEvent e, int id, int x, int y) {
+  if (!__atomic_load_n(&rec.on, __ATOMIC_ACQUIRE))
+    return;
+  Buf b = mybuf();
+  RecRec *r = &b->r[b->n++];
+  r->ts = elapsed();
+  r->tid = (uint32_t)vclock_tid();
+  r->id = id;
+  r->event = e;
+  r->x = x;
+  r->y = y;
+  r->pad = 0;
+  // a simulation flushes each event, so the file's order is the run's
+  if (b->n == RECBUF || vclock_running())
+    flush(b);
+}
+
+/**
+ * Stops recording: flushes every remaining buffer, sets the record count,
+ * and trims the file. Call after the recording threads have been joined.
+ */
+extern void rec_close() {
+  if (!rec.on)
+    return;
+  __atomic_store_n(&rec.on, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&rec.lock);
+  for (Buf b = rec.bufs, next; b; b = next) {
+    next = b->next;
+    flush(b);
+    free(b);
+  }
+  rec.bufs = 0;
+  pthread_mutex_unlock(&rec.lock);
+  pthread_setspecific(rec.key, 0);
+  pthread_key_delete(rec.key);
+
+  long count = rec.reserved < rec.max ? rec.reserved : rec.max;
+  rec.hdr->count = count;
+  if (rec.hdr->dropped)
+    WARN("recorder full: %lu events dropped", (unsigned long)rec.hdr->dropped);
+  munmap(rec.hdr, sizeof(RecHdr) + rec.max * sizeof(RecRec));
+  if (ftruncate(rec.fd, sizeof(RecHdr) + count * sizeof(RecRec)))
+    WARN("ftruncate() failed: %s", strerror(errno));
+  close(rec.fd);
+}
@@ -0,0 +1,39 @@
+#ifndef REC_H
+#define REC_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+
+// A compact binary log of the mole lifecycle. Each thread appends to its
+// own buffer without locking; full buffers are copied into a memory-mapped
+// file at a slot range reserved with one atomic add. A record is 24 bytes.
+
+#define REC_MAGIC   0x524d4157 // "WAMR"
+#define REC_VERSION 1
+
+typedef enum {RecCreating, RecCreated, RecWhacking, RecWhacked, RecExpired, RecDiscarded, RecEvents} RecEvent;
+
+typedef struct {
+  uint64_t ts;    // ns since rec_open
+  uint32_t tid;
+  uint32_t id;    // mole id
+  uint16_t event; // RecEvent
+  uint16_t x, y;
+  uint16_t pad;
+} RecRec;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;    // records in the file
+  uint64_t dropped;  // records lost because the file was full
+  uint32_t lawnsize;
+  uint32_t molesize;
+} RecHdr;
+
+extern LINKAGE void rec_open(const char *path, long max, int lawnsize, int molesize);
+extern LINKAGE void rec_event(RecEvent e, int id, int x, int y);
+extern LINKAGE void rec_close();
+
+#endif
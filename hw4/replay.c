@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "rec.h"
+#include "lawn.h"
+#include "mole.h"
+#include "mtq.h"
+#include "threads.h"
+#include "now.h"
+#include "stop.h"
+#include "error.h"
+
+// One mole's life, gathered from its records
+typedef struct {
+  uint64_t t[RecEvents]; // timestamp of each event
+  int seen;              // bitmask of events present
+  int x, y;
+} Life;
+
+// Worker arguments, shared by every replay thread
+typedef struct {
+  Mtq q;
+  Lawn l;
+  double speed;
+  Config *c;
+  int stopping; // signalled: release no more moles
+  int discard;  // signalled: skip queued moles, and waits
+} Play;
+
+static int by_id(const void *a, const void *b) {
+  const RecRec *p = a, *q = b;
+  if (p->id != q->id) return p->id < q->id ? -1 : 1;
+  return p->ts < q->ts ? -1 : p->ts > q->ts;
+}
+
+static int by_start(const void *a, const void *b) {
+  const Life *p = a, *q = b;
+  return p->t[RecCreating] < q->t[RecCreating] ? -1 : p->t[RecCreating] > q->t[RecCreating];
+}
+
+static int by_u64(const void *a, const void *b) {
+  uint64_t p = *(const uint64_t *)a, q = *(const uint64_t *)b;
+  return p < q ? -1 : p > q;
+}
+
+/* Returns the scaled gap between two events, in ms; 0 if either is missing */
+static int gap(Life *f, RecEvent a, RecEvent b, double speed) {
+  if (!(f->seen & (1 << a)) || !(f->seen & (1 << b)) || f->t[b] < f->t[a])
+    return 0;
+  return (int)((f->t[b] - f->t[a]) / 1e6 / speed);
+}
+
+/**
+ * Replay thread: creates, whacks, and expires one mole at a time,
+ * until the queue is closed and empty.
+ */
+static void *play(void *a) {
+  Play *p = a;
+  Life *f;
+  while ((f = mtq_head_get(p->q))) {
+    if (__atomic_load_n(&p->discard, __ATOMIC_ACQUIRE))
+      continue;
+    Mole m = mole_at(p->l, f->x, f->y,
+                     gap(f, RecCreating, RecCreated, p->speed),
+                     gap(f, RecWhacking, RecWhacked, p->speed),
+                     gap(f, RecWhacked, RecExpired, p->speed));
+    // the time the mole waited in the queue between created and whacking
+    nap_until(now_ns() + gap(f, RecCreated, RecWhacking, p->speed) * 1000000ULL, &p->discard);
+    mole_whack(m);
+  }
+  return 0;
+}
+
+/**
+ * Finds the longest scaled vim, which the lawn's vim units must cover.
+ */
+static int longest(Life *lives, int n, double speed) {
+  int most = 0;
+  for (int i = 0; i < n; i++) {
+    int v[] = {gap(&lives[i], RecCreating, RecCreated, speed),
+               gap(&lives[i], RecWhacking, RecWhacked, speed),
+               gap(&lives[i], RecWhacked, RecExpired, speed)};
+    for (int j = 0; j < 3; j++)
+      if (v[j] > most) most = v[j];
+  }
+  return most;
+}
+
+/**
+ * Counts the most moles alive at once, so the replay has a thread for each.
+ */
+static int peak(Life *lives, int n) {
+  uint64_t *on = malloc(sizeof(*on) * n), *off = malloc(sizeof(*off) * n);
+  if (!on || !off) ERROR("malloc() failed");
+  for (int i = 0; i < n; i++) {
+    on[i] = lives[i].t[RecCreating];
+    off[i] = lives[i].seen & (1 << RecExpired) ? lives[i].t[RecExpired] : UINT64_MAX;
+  }
+  qsort(on, n, sizeof(*on), by_u64);
+  qsort(off, n, sizeof(*off), by_u64);
+  int live = 0, most = 0;
+  for (int i = 0, j = 0; i < n;)
+    if (on[i] < off[j]) {
+      if (++live > most) most = live;
+      i++;
+    } else {
+      live--;
+      j++;
+    }
+  free(on);
+  free(off);
+  return most;
+}
+
+/**
+ * Reads a recording and groups its records into one Life per mole,
+ * ordered by creation time.
+ *
+ * @return the number of lives; *lives is malloc()ed.
+ */
+static int load(const char *path, Life **lives, int *lawnsize, int *molesize) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) ERROR("open(%s) failed: %s", path, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st)) ERROR("fstat() failed: %s", strerror(errno));
+  if (st.st_size < (off_t)sizeof(RecHdr)) ERROR("%s: not a recording", path);
+  RecHdr *h = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (h == MAP_FAILED) ERROR("mmap() failed: %s", strerror(errno));
+  close(fd);
+  if (h->magic != REC_MAGIC || h->version != REC_VERSION)
+    ERROR("%s: not a version %d recording", path, REC_VERSION);
+  if (sizeof(RecHdr) + h->count * sizeof(RecRec) > (size_t)st.st_size)
+    ERROR("%s: truncated", path);
+
+  // records are in flush order, so sort a copy by mole
+  long n = h->count;
+  RecRec *r = malloc(sizeof(*r) * (n ? n : 1));
+  if (!r) ERROR("malloc() failed");
+  memcpy(r, h + 1, sizeof(*r) * n);
+  *lawnsize = h->lawnsize;
+  *molesize = h->molesize;
+  munmap(h, st.st_size);
+  qsort(r, n, sizeof(*r), by_id);
+
+  Life *f = calloc(n ? n : 1, sizeof(*f));
+  if (!f) ERROR("calloc() failed");
+  int k = -1;
+  for (long i = 0; i < n; i++) {
+    if (i == 0 || r[i].id != r[i - 1].id)
+      k++;
+    if (r[i].event >= RecEvents)
+      continue;
+    f[k].t[r[i].event] = r[i].ts;
+    f[k].seen |= 1 << r[i].event;
+    f[k].x = r[i].x;
+    f[k].y = r[i].y;
+  }
+  free(r);
+
+  // a mole recorded mid-life has no creation to replay
+  int lives_n = 0;
+  for (int i = 0; i <= k; i++)
+    if (f[i].seen & (1 << RecCreating))
+      f[lives_n++] = f[i];
+  qsort(f, lives_n, sizeof(*f), by_start);
+  *lives = f;
+  return lives_n;
+}
+
+/*
+ * Stops a replay, on a signal: no more moles are released, and the queue
+ * is closed, so the players finish those released, or, under the discard
+ * policy or when the stop runs late, skip them, with the delays of moles
+ * in flight hurried.
+ */
+static void stopped(void *a, int hard) {
+  Play *p = a;
+  __atomic_store_n(&p->stopping, 1, __ATOMIC_RELEASE);
+  if (hard || !strcmp(p->c->stop_policy, "discard")) {
+    __atomic_store_n(&p->discard, 1, __ATOMIC_RELEASE);
+    lawn_hurry(p->l);
+  }
+  mtq_close(p->q);
+}
+
+/**
+ * Replays a recording through a new lawn.
+ *
+ * @param c the configuration: c->replay, a file written by
+ *          rec_open()/rec_close(), and c->replay_speed, a time divisor:
+ *          1 is real time, 10 is ten times faster.
+ */
+extern void replay(Config *c) {
+  const char *path = c->replay;
+  double speed = c->replay_speed;
+  if (speed <= 0) ERROR("bad replay speed: %g", speed);
+  Life *lives;
+  int lawnsize, molesize;
+  int n = load(path, &lives, &lawnsize, &molesize);
+  int threads = peak(lives, n);
+
+  Play p = {mtq_new(0), lawn_new(lawnsize, molesize), speed, c};
+  lawn_vims(p.l, longest(lives, n, speed));
+  stop_on(stopped, &p, c->stop_budget);
+  pthread_t **players = create_threads(play, threads, &p);
+
+  // release each mole at its scaled creation time, then close the queue,
+  // so each player ends once it is empty
+  uint64_t t0 = now_ns();
+  for (int i = 0; i < n; i++) {
+    uint64_t at = t0 + (uint64_t)((lives[i].t[RecCreating] - lives[0].t[RecCreating]) / speed);
+    if (nap_until(at, &p.stopping) || mtq_tail_put(p.q, &lives[i]) == MtqClosed)
+      break;
+  }
+  mtq_close(p.q);
+
+  wait_threads(players, threads);
+  stop_on(0, 0, 0);
+  lawn_free(p.l);
+  mtq_del(p.q, 0);
+  free(lives);
+}
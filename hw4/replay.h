@@ -0,0 +1,13 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "config.h"
+
+// Replays a log written by rec.c through a new lawn of the recorded size.
+// Every mole is created at its recorded time and position and lives
+// through its recorded phases, with all times divided by speed. A signal
+// stops it as stop.h says: no more moles are released.
+
+extern void replay(Config *c); // c->replay, at c->replay_speed
+
+#endif
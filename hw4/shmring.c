@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shmring.h"
+#include "error.h"
+
+#define MAGIC   0x534d4157u // "WAMS", little-endian
+#define VERSION 1
+
+// The shared layout. head and tail are on their own cache lines, so the
+// two processes do not false-share.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t lawnsize, molesize;
+  uint32_t slots;      // a power of two
+  uint32_t closed;
+  char pad0[64 - 6 * sizeof(uint32_t)];
+  uint64_t head;       // next slot to write; the producer's
+  char pad1[64 - sizeof(uint64_t)];
+  uint64_t tail;       // next slot to read; the consumer's
+  char pad2[64 - sizeof(uint64_t)];
+  uint32_t slot[];
+} Shared;
+
+// Representation of a ShmRing: one side's view
+typedef struct {
+  Shared *s;
+  size_t len;
+  char *name;          // the creator's, to unlink; else 0
+  uint64_t head, tail; // this side's copy of its own index, and cache of the other's
+} *Rep;
+
+static Rep rep(ShmRing r) {
+  if (!r) ERROR("zero pointer");
+  return (Rep)r;
+}
+
+/**
+ * Creates a ring, replacing any left by an earlier run.
+ *
+ * @param name the shared-memory name, e.g. "/wam-lawn".
+ * @param lawnsize moles per side, for the viewer.
+ * @param molesize pixels per mole side, for the viewer.
+ * @param slots events the ring holds; rounded up to a power of two.
+ *
+ * @return the producer's side of the ring.
+ */
+extern ShmRing shmring_create(const char *name, int lawnsize, int molesize, int slots) {
+  uint32_t n = 1;
+  while (n < (uint32_t)slots)
+    n <<= 1;
+  size_t len = sizeof(Shared) + n * sizeof(uint32_t);
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) ERROR("shm_open(%s) failed: %s", name, strerror(errno));
+  if (ftruncate(fd, len)) ERROR("ftruncate() failed: %s", strerror(errno));
+  Shared *s = (Shared *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED) ERROR("mmap() failed: %s", strerror(errno));
+  s->version = VERSION;
+  s->lawnsize = lawnsize;
+  s->molesize = molesize;
+  s->slots = n;
+  // a viewer trusts the ring once it sees the magic
+  __atomic_store_n(&s->magic, MAGIC, __ATOMIC_RELEASE);
+
+  Rep r = (Rep)calloc(1, sizeof(*r));
+  if (!r) ERROR("calloc() failed");
+  r->s = s;
+  r->len = len;
+  r->name = strdup(name);
+  return r;
+}
+
+/**
+ * Attaches to a ring created by another process.
+ *
+ * @param name the shared-memory name.
+ *
+ * @return the consumer's side of the ring, or 0 if it does not exist,
+ * or is not yet initialized.
+ */
+extern ShmRing shmring_attach(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+    return 0;
+  Shared *s = (Shared *)mmap(0, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (s == MAP_FAILED) ERROR("mmap() failed: %s", strerror(errno));
+  if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != MAGIC) {
+    munmap(s, sizeof(Shared));
+    close(fd);
+    return 0;
+  }
+  if (s->version != VERSION) ERROR("%s: version %u, not %u", name, s->version, VERSION);
+  size_t len = sizeof(Shared) + s->slots * sizeof(uint32_t);
+  munmap(s, sizeof(Shared));
+  s = (Shared *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED) ERROR("mmap() failed: %s", strerror(errno));
+
+  Rep r = (Rep)calloc(1, sizeof(*r));
+  if (!r) ERROR("calloc() failed");
+  r->s = s;
+  r->len = len;
+  r->tail = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+  return r;
+}
+
+/* Producer: appends an event; returns 0 if the ring is full */
+extern int shmring_push(ShmRing ring, uint32_t e) {
+  Rep r = rep(ring);
+  Shared *s = r->s;
+  if (r->head - r->tail == s->slots) {
+    r->tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+    if (r->head - r->tail == s->slots)
+      return 0;
+  }
+  s->slot[r->head & (s->slots - 1)] = e;
+  __atomic_store_n(&s->head, ++r->head, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Consumer: takes the oldest event; returns 0 if the ring is empty */
+extern int shmring_pop(ShmRing ring, uint32_t *e) {
+  Rep r = rep(ring);
+  Shared *s = r->s;
+  if (r->tail == r->head) {
+    r->head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+    if (r->tail == r->head)
+      return 0;
+  }
+  *e = s->slot[r->tail & (s->slots - 1)];
+  __atomic_store_n(&s->tail, ++r->tail, __ATOMIC_RELEASE);
+  return 1;
+}
+
+extern void shmring_lawn(ShmRing ring, int *lawnsize, int *molesize) {
+  Rep r = rep(ring);
+  *lawnsize = r->s->lawnsize;
+  *molesize = r->s->molesize;
+}
+
+/* Producer: marks the ring finished, after its last push */
+extern void shmring_close(ShmRing ring) {
+  __atomic_store_n(&rep(ring)->s->closed, 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer: returns 1 once the producer has finished; events may remain */
+extern int shmring_closed(ShmRing ring) {
+  return __atomic_load_n(&rep(ring)->s->closed, __ATOMIC_ACQUIRE);
+}
+
+extern void shmring_free(ShmRing ring) {
+  Rep r = rep(ring);
+  munmap(r->s, r->len);
+  if (r->name) {
+    shm_unlink(r->name);
+    free(r->name);
+  }
+  free(r);
+}
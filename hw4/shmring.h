@@ -0,0 +1,29 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+
+// A single-producer, single-consumer ring of lawn events in POSIX shared
+// memory, from wam (which creates it) to a viewer process (which attaches
+// to it). The producer owns head and the consumer owns tail, so neither
+// side locks or waits on the other: push fails when the ring is full, pop
+// when it is empty. An event packs a cell index and its new RasterState.
+
+typedef void *ShmRing;
+
+#define SHMRING_EVENT(cell,state) ((uint32_t)(cell) << 2 | (uint32_t)(state))
+#define SHMRING_CELL(e)           ((e) >> 2)
+#define SHMRING_STATE(e)          ((e) & 3)
+
+extern LINKAGE ShmRing shmring_create(const char *name, int lawnsize, int molesize, int slots);
+extern LINKAGE ShmRing shmring_attach(const char *name); // 0 if there is none yet
+extern LINKAGE int     shmring_push(ShmRing r, uint32_t e);  // 0 if full
+extern LINKAGE int     shmring_pop(ShmRing r, uint32_t *e);  // 0 if empty
+extern LINKAGE void    shmring_lawn(ShmRing r, int *lawnsize, int *molesize);
+extern LINKAGE void    shmring_close(ShmRing r);             // no more pushes
+extern LINKAGE int     shmring_closed(ShmRing r);
+extern LINKAGE void    shmring_free(ShmRing r);              // the creator also unlinks it
+
+#endif
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snap.h"
+#include "mole.h"
+#define LAWNIMP
+#include "lawnimp.h"
+#undef LAWNIMP
+#include "error.h"
+#include "now.h"
+#include "mem.h"
+
+// Snapshotter state: one per process
+static struct {
+  pthread_mutex_t lock; // serializes snapshots, which share a temporary file
+  char *path;           // the periodic snapshotter's, while it runs
+  int period;           // ms, 0 = on SIGUSR1 only
+  Mtq q;
+  Lawn l;
+  int stop;
+  pthread_t thread;
+} snap = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Moles packed under the mtq's lock, into room made before taking it
+typedef struct {
+  char *buf;   // mole_size() bytes each
+  Data *moles;
+  int n, max;
+} Pack;
+
+static void pack(Data d, void *a) {
+  Pack *p = a;
+  if (!d || p->n == p->max)
+    return; // an end-of-work marker, or no room: the caller tries again
+  mole_save(d, p->buf + (size_t)p->n * mole_size());
+  p->moles[p->n++] = d;
+}
+
+/* Makes room in a pack for n more moles */
+static void room(Pack *p, int n) {
+  p->max = p->n + n;
+  p->buf = realloc(p->buf, (size_t)p->max * mole_size());
+  p->moles = realloc(p->moles, p->max * sizeof(Data));
+  if (!p->buf || !p->moles) ERROR("realloc() failed");
+}
+
+/* Writes all of len bytes at off; returns 0, or an errno */
+static int put(int fd, const void *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return errno;
+    buf = (const char *)buf + n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+/*
+ * Writes a snapshot to path.tmp, syncs it, renames it over path, and
+ * syncs the directory, so that after a crash path is the old snapshot or
+ * the new one, whole. Returns 0, or an errno.
+ */
+static int store(const char *path, SnapHdr *h, Pack *p) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return errno;
+  int e = put(fd, h, sizeof(*h), 0);
+  if (!e)
+    e = put(fd, p->buf, (size_t)p->n * mole_size(), sizeof(*h));
+  if (!e && fsync(fd))
+    e = errno;
+  if (close(fd) && !e)
+    e = errno;
+  if (!e && rename(tmp, path))
+    e = errno;
+  if (e) {
+    unlink(tmp);
+    return e;
+  }
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  int d = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+  if (d < 0)
+    return errno;
+  if (fsync(d))
+    e = errno;
+  close(d);
+  return e;
+}
+
+/**
+ * Writes a snapshot of the moles queued in an mtq, in queue order. The
+ * moles are packed under the mtq's lock, so they are its contents at one
+ * instant, into room made before it is taken, then written to path.tmp,
+ * which is synced and replaces path, so a reader sees the old snapshot or
+ * the new one, never a part, even after a crash. Moles taken are
+ * discarded from the lawn by the caller's thread, which should not be
+ * one that must return promptly.
+ *
+ * @param path the snapshot.
+ * @param q the mtq.
+ * @param l the lawn of its moles.
+ * @param take nonzero to take the moles out of the mtq and discard them,
+ *             as they now belong to whichever process restores them.
+ *
+ * @return the number of moles written, or -1 if the snapshot failed.
+ */
+extern int snap_save(const char *path, Mtq q, Lawn l, int take) {
+  pthread_mutex_lock(&snap.lock);
+  uint64_t t0 = now_ns();
+  Pack p = {0};
+  for (;;) {
+    int more = mtq_len(q) + 64;
+    room(&p, more);
+    int n = mtq_map(q, pack, &p, take, more);
+    if (take ? n < more : n <= p.max)
+      break;
+    // it grew while we made room: a take keeps what it took, a look starts over
+    if (!take)
+      p.n = 0;
+  }
+
+  LawnRep r = (LawnRep)l;
+  SnapHdr h = {SNAP_MAGIC, SNAP_VERSION, p.n, r->lawnsize, r->molesize, r->quantum, mole_size()};
+  int e = store(path, &h, &p);
+  pthread_mutex_unlock(&snap.lock);
+
+  for (int i = 0; take && i < p.n; i++)
+    mole_discard(p.moles[i]);
+  if (e)
+    WARN("snapshot: %s: %s%s", path, strerror(e), take && p.n ? "; its moles are lost" : "");
+  else
+    log_msg(2, "snapshot: %d moles to %s in %.2fms", p.n, path, (now_ns() - t0) / 1e6);
+  free(p.buf);
+  free(p.moles);
+  return e ? -1 : p.n;
+}
+
+/**
+ * Restores the moles of a snapshot into an mtq, in order, and removes the
+ * snapshot, so they are not restored twice. The file is mapped privately
+ * and each mole is adopted where it lies, shown at once, without its
+ * create delay; the mapping is never unmapped, and a freed mole's bytes
+ * are reused for new moles. They are queued past the mtq's capacity, if
+ * need be, as they were admitted by the process that saved them.
+ *
+ * @param path the snapshot; if there is none, nothing is restored.
+ * @param q the mtq.
+ * @param l the lawn, which must be the same size as the snapshot's.
+ *
+ * @return the number of moles restored.
+ */
+extern int snap_restore(const char *path, Mtq q, Lawn l) {
+  uint64_t t0 = now_ns();
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 && errno == ENOENT) {
+    log_msg(2, "snapshot: none at %s", path);
+    return 0;
+  }
+  if (fd < 0) ERROR("open(%s) failed: %s", path, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st)) ERROR("fstat() failed: %s", strerror(errno));
+  if (st.st_size < (off_t)sizeof(SnapHdr)) ERROR("%s: not a snapshot", path);
+  SnapHdr *h = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (h == MAP_FAILED) ERROR("mmap() failed: %s", strerror(errno));
+  close(fd);
+  if (h->magic != SNAP_MAGIC || h->version != SNAP_VERSION)
+    ERROR("%s: not a version %d snapshot", path, SNAP_VERSION);
+  if (h->size != (uint32_t)mole_size())
+    ERROR("%s: moles of %u bytes, not %d", path, h->size, mole_size());
+  LawnRep r = (LawnRep)l;
+  if (h->lawnsize != (uint32_t)r->lawnsize || h->molesize != (uint32_t)r->molesize)
+    ERROR("%s: a lawn of %u moles of %u pixels, not %d of %d", path,
+          h->lawnsize, h->molesize, r->lawnsize, r->molesize);
+  if (sizeof(SnapHdr) + h->count * h->size > (size_t)st.st_size)
+    ERROR("%s: truncated", path);
+  if (unlink(path)) ERROR("unlink(%s) failed: %s", path, strerror(errno));
+  mem_add(MemMoles, st.st_size);
+
+  int n = h->count;
+  Data *moles = malloc((n ? n : 1) * sizeof(Data));
+  if (!moles) ERROR("malloc() failed");
+  for (int i = 0; i < n; i++)
+    moles[i] = mole_load(l, (char *)(h + 1) + (size_t)i * h->size, h->quantum);
+  mtq_tail_putall(q, moles, n);
+  free(moles);
+  log_msg(2, "snapshot: %d moles from %s in %.2fms", n, path, (now_ns() - t0) / 1e6);
+  return n;
+}
+
+/* Snapshotter: writes a snapshot each period, and on each SIGUSR1 */
+static void *run(void *a) {
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  for (;;) {
+    if (snap.period) {
+      struct timespec t = {snap.period / 1000, (snap.period % 1000) * 1000000L};
+      sigtimedwait(&usr1, 0, &t);
+    } else
+      sigwaitinfo(&usr1, 0);
+    if (__atomic_load_n(&snap.stop, __ATOMIC_ACQUIRE))
+      return 0;
+    snap_save(snap.path, snap.q, snap.l, 0);
+  }
+}
+
+/**
+ * Starts writing snapshots of an mtq, each period and on each SIGUSR1.
+ * SIGUSR1 must be blocked in every thread, so that it reaches only the
+ * snapshotter, which waits for it: main blocks it before making any.
+ *
+ * @param path the snapshot.
+ * @param period_ms how often, 0 = on SIGUSR1 only.
+ * @param q the mtq.
+ * @param l the lawn of its moles.
+ */
+extern void snap_start(const char *path, int period_ms, Mtq q, Lawn l) {
+  snap.path = strdup(path);
+  snap.period = period_ms;
+  snap.q = q;
+  snap.l = l;
+  snap.stop = 0;
+  if (pthread_create(&snap.thread, 0, run, 0))
+    ERROR("pthread_create() failed");
+}
+
+/**
+ * Stops the snapshotter, and writes a last snapshot, taking what is left
+ * in the mtq. Call it once the consumers are done: at the end of a run,
+ * the mtq is empty, so a restart restores nothing that was whacked; after
+ * a stop, it holds the moles the consumers left for the snapshot.
+ */
+extern void snap_stop() {
+  if (!snap.path)
+    return;
+  __atomic_store_n(&snap.stop, 1, __ATOMIC_RELEASE);
+  pthread_kill(snap.thread, SIGUSR1);
+  pthread_join(snap.thread, 0);
+  snap_save(snap.path, snap.q, snap.l, 1);
+  free(snap.path);
+  snap.path = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+#include "mtq.h"
+#include "lawn.h"
+
+// Snapshots of the moles queued in an mtq, for a warm restart. A snapshot
+// is a header and each mole's fields, as mole_save stores them, in queue
+// order; it is written to a temporary file, synced, which then replaces
+// the snapshot. A restore maps the file, privately, and queues the moles
+// in place, so it neither copies nor recreates them.
+
+#define SNAP_MAGIC   0x504d4157 // "WAMP", little-endian; shmring.c has "WAMS"
+#define SNAP_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;     // moles in the file
+  uint32_t lawnsize;
+  uint32_t molesize;
+  uint32_t quantum;   // ms per unit of the moles' vims
+  uint32_t size;      // bytes per mole
+} SnapHdr;
+
+extern LINKAGE int  snap_save(const char *path, Mtq q, Lawn l, int take); // -1 if it failed
+extern LINKAGE int  snap_restore(const char *path, Mtq q, Lawn l);
+extern LINKAGE void snap_start(const char *path, int period_ms, Mtq q, Lawn l); // and on SIGUSR1
+extern LINKAGE void snap_stop(); // once consumers are done: takes what they left
+
+#endif
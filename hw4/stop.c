@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stop.h"
+#include "now.h"
+#include "log.h"
+#include "error.h"
+
+static struct {
+  pthread_mutex_t lock; // guards f, arg and budget, so unregistering waits out a call
+  StopF f;
+  void *arg;
+  int budget;           // ms, 0 = none
+  uint64_t t0;          // now_ns() at the first signal, or 0
+} stop = {PTHREAD_MUTEX_INITIALIZER};
+
+static void call(int hard) {
+  pthread_mutex_lock(&stop.lock);
+  if (stop.f)
+    stop.f(stop.arg, hard);
+  pthread_mutex_unlock(&stop.lock);
+}
+
+/* Escalates a stop that overruns its budget: discards at half, exits at all of it */
+static void *watchdog(void *a) {
+  int budget = (int)(long)a;
+  sleep_until(stop.t0 + budget * 1000000ULL / 2);
+  WARN("stop: still draining after %dms; discarding the rest", budget / 2);
+  call(1);
+  sleep_until(stop.t0 + budget * 1000000ULL);
+  WARN("stop: over its %dms budget; exiting now", budget);
+  log_flush();
+  _exit(1);
+}
+
+/* Waits for SIGINT and SIGTERM, and stops on the first */
+static void *signals(void *a) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  for (;;) {
+    int sig;
+    if (sigwait(&set, &sig))
+      continue;
+    if (stop.t0) {
+      log_msg(2, "stop: %s again; exiting now", strsignal(sig));
+      log_flush();
+      _exit(128 + sig);
+    }
+    pthread_mutex_lock(&stop.lock);
+    if (!stop.f) {
+      // nothing to drain: die of the signal, as if it were not handled,
+      // rather than run exit handlers under threads still working
+      pthread_mutex_unlock(&stop.lock);
+      log_flush();
+      signal(sig, SIG_DFL);
+      sigset_t one;
+      sigemptyset(&one);
+      sigaddset(&one, sig);
+      pthread_sigmask(SIG_UNBLOCK, &one, 0);
+      raise(sig);
+      _exit(128 + sig);
+    }
+    __atomic_store_n(&stop.t0, now_ns(), __ATOMIC_RELEASE);
+    if (stop.budget)
+      log_msg(2, "stop: %s; draining, within %dms", strsignal(sig), stop.budget);
+    else
+      log_msg(2, "stop: %s; draining", strsignal(sig));
+    stop.f(stop.arg, 0);
+    pthread_t t;
+    if (stop.budget && pthread_create(&t, 0, watchdog, (void *)(long)stop.budget))
+      ERROR("pthread_create() failed");
+    if (stop.budget)
+      pthread_detach(t);
+    pthread_mutex_unlock(&stop.lock);
+  }
+  return 0;
+}
+
+/**
+ * Handles SIGINT and SIGTERM from here on. Call it before creating other
+ * threads, which inherit the signals blocked, so they reach only the
+ * thread that waits for them.
+ */
+extern void stop_signals() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, 0);
+  pthread_t t;
+  if (pthread_create(&t, 0, signals, 0))
+    ERROR("pthread_create() failed");
+  pthread_detach(t);
+}
+
+/**
+ * Registers what a signal stops. Unregister it, with f 0, before freeing
+ * what it stops; that waits for a call in progress to return.
+ *
+ * @param f called with hard 0 on the first signal, and with hard 1 at
+ *          half the budget; it must return promptly.
+ * @param arg passed to f.
+ * @param budget_ms how long the process may take to exit, 0 = no limit.
+ */
+extern void stop_on(StopF f, void *arg, int budget_ms) {
+  pthread_mutex_lock(&stop.lock);
+  stop.f = f;
+  stop.arg = arg;
+  stop.budget = budget_ms;
+  pthread_mutex_unlock(&stop.lock);
+}
+
+extern int stop_requested() {
+  return __atomic_load_n(&stop.t0, __ATOMIC_ACQUIRE) != 0;
+}
+
+extern double stop_ms() {
+  uint64_t t0 = __atomic_load_n(&stop.t0, __ATOMIC_ACQUIRE);
+  return t0 ? (now_ns() - t0) / 1e6 : 0;
+}
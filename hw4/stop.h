@@ -0,0 +1,22 @@
+#ifndef STOP_H
+#define STOP_H
+
+#include "linkage.h"
+
+// Shutdown on SIGINT or SIGTERM, in bounded time. The first signal calls
+// the registered StopF, softly, to stop making work and drain what is in
+// flight; at half the budget, if the process is still running, it is
+// called again, hard, to discard what is left; at the whole budget, the
+// process exits at once. A second signal exits at once, too. With no
+// StopF registered, a signal has its default action. Each run mode that
+// has threads to drain (the closed loop, pipeline, loadgen, tiers and
+// replay) registers one while they run; a sweep does not.
+
+typedef void (*StopF)(void *arg, int hard);
+
+extern LINKAGE void   stop_signals(); // before any other thread, which inherit them blocked
+extern LINKAGE void   stop_on(StopF f, void *arg, int budget_ms); // f 0 to unregister
+extern LINKAGE int    stop_requested();
+extern LINKAGE double stop_ms(); // since the first signal
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "sweep.h"
+#include "mtq.h"
+#include "threads.h"
+#include "hist.h"
+#include "now.h"
+#include "error.h"
+
+// One run of one point
+typedef struct {
+  Mtq q;
+  Hist lat;         // put to get, ns; each consumer's is moved in at its end
+  uint64_t end;     // producers stop here
+  uint64_t got;     // items put before end, and taken
+  int stop;
+} Rep;
+
+/**
+ * Puts timestamps, each of which is its own item, until told to stop.
+ *
+ * @param a the Rep.
+ */
+static void *produce(void *a) {
+  Rep *r = a;
+  while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+    uint64_t t = now_ns();
+    mtq_tail_put(r->q, (Data)(uintptr_t)t);
+  }
+  return 0;
+}
+
+/**
+ * Takes items until it takes a 0, timing each in a histogram of its own,
+ * so consumers do not contend on the shared one.
+ *
+ * @param a the Rep.
+ */
+static void *consume(void *a) {
+  Rep *r = a;
+  Hist h = hist_new();
+  uint64_t n = 0;
+  Data d;
+  while ((d = mtq_head_get(r->q))) {
+    uint64_t t = (uint64_t)(uintptr_t)d;
+    hist_add(h, now_ns() - t);
+    n += t < r->end;
+  }
+  hist_move(r->lat, h);
+  hist_free(h);
+  __atomic_add_fetch(&r->got, n, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static double secs(struct timeval t) {
+  return t.tv_sec + t.tv_usec / 1e6;
+}
+
+/* Two-sided 95% Student t quantile, for n-1 degrees of freedom */
+static double t95(int n) {
+  static const double t[] = {0, 12.706, 4.303, 3.182, 2.776, 2.571,
+                             2.447, 2.365, 2.306, 2.262, 2.228};
+  return n - 1 < (int)(sizeof(t) / sizeof(t[0])) ? t[n - 1] : 1.96;
+}
+
+/**
+ * Runs one point c->sweep_reps times and writes its CSV row.
+ *
+ * @param c the configuration.
+ * @param f the CSV.
+ * @param p producer threads.
+ * @param n consumer threads.
+ * @param cap queue capacity, 0 = unbounded.
+ */
+static void point(Config *c, FILE *f, int p, int n, int cap) {
+  int reps = c->sweep_reps;
+  double rate[reps], sum = 0, var = 0, wall = 0, cpu = 0, vcsw = 0, ivcsw = 0;
+  Hist lat = hist_new();
+  for (int i = 0; i < reps; i++) {
+    Rep r = {mtq_new(cap), lat};
+    struct rusage u0, u1;
+    getrusage(RUSAGE_SELF, &u0);
+    uint64_t start = now_ns();
+    r.end = start + c->sweep_time * 1000000ULL;
+    pthread_t **consumers = create_threads(consume, n, &r);
+    pthread_t **producers = create_threads(produce, p, &r);
+    sleep_until(r.end);
+    __atomic_store_n(&r.stop, 1, __ATOMIC_RELAXED);
+    wait_threads(producers, p);
+    for (int j = 0; j < n; j++)
+      mtq_tail_put_wait(r.q, 0);
+    wait_threads(consumers, n);
+    double s = (now_ns() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &u1);
+    mtq_del(r.q, 0);
+
+    rate[i] = r.got / (c->sweep_time / 1e3);
+    sum += rate[i];
+    wall += s;
+    cpu += secs(u1.ru_utime) - secs(u0.ru_utime) + secs(u1.ru_stime) - secs(u0.ru_stime);
+    vcsw += u1.ru_nvcsw - u0.ru_nvcsw;
+    ivcsw += u1.ru_nivcsw - u0.ru_nivcsw;
+  }
+  double mean = sum / reps;
+  for (int i = 0; i < reps; i++)
+    var += (rate[i] - mean) * (rate[i] - mean);
+  double ci = reps > 1 ? t95(reps) * sqrt(var / (reps - 1) / reps) : 0;
+  fprintf(f, "%s,%d,%d,%d,%d,%d,%.0f,%.0f,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f,%.2f\n",
+          c->engine, p + n, p, n, cap, reps, mean, ci,
+          hist_pct(lat, 50) / 1e3, hist_pct(lat, 99) / 1e3, hist_pct(lat, 99.9) / 1e3,
+          hist_max(lat) / 1e3, vcsw / wall, ivcsw / wall, cpu / wall);
+  fflush(f);
+  log_msg(2, "sweep: %s p=%d c=%d cap=%d: %.0f/s +-%.0f", c->engine, p, n, cap, mean, ci);
+  hist_free(lat);
+}
+
+/**
+ * Runs the sweep.
+ *
+ * @param c the configuration.
+ */
+extern void sweep(Config *c) {
+  static const int caps[] = {1, 4, 64, 0};
+  static const int ratio[][2] = {{1, 1}, {1, 3}, {3, 1}};
+  if (c->sweep_reps < 1 || c->sweep_time < 1)
+    ERROR("sweep needs sweep_reps and sweep_time above 0");
+  FILE *f = strcmp(c->sweep, "-") ? fopen(c->sweep, "w") : stdout;
+  if (!f)
+    ERROR("cannot write %s", c->sweep);
+
+  // a point needs a producer and a consumer, so threads start at 2; they
+  // go to twice the cores, and past the cores to 8, even on a small host
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int top = 2 * cores < 8 ? 8 : 2 * cores;
+  fprintf(f, "engine,threads,producers,consumers,capacity,reps,ops_per_s,ops_ci95,"
+             "p50_us,p99_us,p999_us,max_us,vcsw_per_s,ivcsw_per_s,cpus\n");
+  for (int t = 2;; t = t * 2 < top ? t * 2 : top) {
+    for (int k = 0; k < (int)(sizeof(caps) / sizeof(caps[0])); k++)
+      for (int j = 0; j < (int)(sizeof(ratio) / sizeof(ratio[0])); j++) {
+        int p = t * ratio[j][0] / (ratio[j][0] + ratio[j][1]);
+        p = p < 1 ? 1 : p > t - 1 ? t - 1 : p;
+        // a small t cannot make every ratio; skip the repeats
+        if (j && p == t / 2)
+          continue;
+        point(c, f, p, t - p, caps[k]);
+      }
+    if (t >= top)
+      break;
+  }
+  if (f != stdout)
+    fclose(f);
+}
@@ -0,0 +1,16 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "config.h"
+
+// Scalability sweep: runs the bare produce/consume core, with no lawn,
+// over thread counts (2, the least that is a producer and a consumer,
+// doubling to twice the cores, or to 8 on up to 4), capacities (1, 4, 64 and
+// unbounded) and producer:consumer ratios (1:1, 1:3, 3:1). Each point runs
+// c->sweep_reps times for c->sweep_time, and one CSV row per point goes
+// to c->sweep ("-" for stdout): throughput with a 95% confidence
+// interval, put-to-get latency percentiles, context switches and CPU use.
+
+extern void sweep(Config *c);
+
+#endif
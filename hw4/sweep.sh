@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs the scalability sweep and, if gnuplot is installed, plots
+# throughput against threads for each capacity, one chart per engine.
+# usage: ./sweep.sh [csv] [wam options...], e.g. ./sweep.sh out.csv --engine=mutex
+
+csv=${1:-sweep.csv}
+[ $# -gt 0 ] && shift
+./wam --sweep="$csv" "$@" || exit 1
+echo "sweep: wrote $csv"
+
+command -v gnuplot >/dev/null || { echo "sweep: no gnuplot, so no plot"; exit 0; }
+for engine in $(tail -n +2 "$csv" | cut -d, -f1 | sort -u); do
+  png=${csv%.csv}-$engine.png
+  gnuplot <<PLOT
+set datafile separator ","
+set terminal png size 1000,600
+set output "$png"
+set title "$engine: producers = consumers"
+set xlabel "threads"
+set ylabel "items/s"
+set logscale x 2
+set key top left
+plot for [cap in "1 4 64 0"] "$csv" every ::1 \
+  using (strcol(1) eq "$engine" && \$3 == \$4 && \$5 == cap ? \$2 : 1/0):7:8 \
+  with yerrorlines title (cap == 0 ? "unbounded" : "capacity ".cap)
+PLOT
+  echo "sweep: wrote $png"
+done
@@ -1,5 +1,33 @@
 #include "threads.h"
 #include "error.h"
+#include "metrics.h"
+#include "vclock.h"
+
+#define LIVE "wam_threads_live", "producer and consumer threads not yet joined"
+
+// A thread; the pthread_t comes first, so callers see just that
+typedef struct
+{
+    pthread_t thread;
+    void *sim; // its simulated thread, in a simulation
+    TFunction f;
+    void *arg;
+} Thread;
+
+/**
+ * Runs a simulated thread's function between its first turn and its exit.
+ *
+ * @param a pointer to its Thread.
+ * @return what the function returns.
+ */
+static void *simulated(void *a)
+{
+    Thread *t = a;
+    vclock_enter(t->sim);
+    void *r = t->f(t->arg);
+    vclock_exit();
+    return r;
+}
 
 
 /**
@@ -12,21 +40,27 @@
 pthread_t *create_individual_thread(TFunction f, void *arg)
 {
     // allocate memory for thread
-    pthread_t *thread = malloc(sizeof(pthread_t));
+    Thread *thread = malloc(sizeof(Thread));
     if (!thread)
     {
         ERROR("Memory allocation failed for thread");
     }
+    thread->sim = vclock_spawn();
+    thread->f = f;
+    thread->arg = arg;
 
-    // create thread that will execute f
-    int returnVal = pthread_create(thread, NULL, f, arg);
+    // create thread that will execute f, when the scheduler says so if simulated
+    int returnVal = thread->sim ? pthread_create(&thread->thread, NULL, simulated, thread)
+                                : pthread_create(&thread->thread, NULL, f, arg);
     if (returnVal)
     {
         ERROR("Thread creation failed");
     }
+    COUNT("wam_threads_created_total", "producer and consumer threads created", 1);
+    GAUGE(LIVE, 1);
 
     // return pointer to created thread
-    return thread;
+    return &thread->thread;
 }
 
 /**
@@ -64,7 +98,11 @@ pthread_t **create_threads(TFunction f, int n, void *arg)
 void wait_individual_thread(pthread_t *thread)
 {
     void *exitCode;
-    // wait for thread to terminate
+    // wait for thread to terminate, in virtual time first if simulated
+    if (((Thread *)thread)->sim)
+    {
+        vclock_join(((Thread *)thread)->sim);
+    }
     int returnVal = pthread_join(*thread, &exitCode);
 
     if (returnVal)
@@ -74,6 +112,7 @@ void wait_individual_thread(pthread_t *thread)
 
     // free mem for the thread
     free(thread);
+    GAUGE(LIVE, -1);
 }
 
 /**
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "tiers.h"
+#include "mtqshm.h"
+#include "mole.h"
+#include "threads.h"
+#include "stop.h"
+#include "error.h"
+
+// A mole as it crosses between processes
+typedef struct {
+  int32_t x, y;
+  int32_t vim0, vim1, vim2; // ms
+} Packed;
+
+// State shared by a process's threads
+typedef struct {
+  Config *c;
+  MtqShm q;
+  Lawn l;
+  long left; // moles still to make
+} Tier;
+
+static int rdm(int lo, int hi) {
+  return random() % (hi - lo + 1) + lo;
+}
+
+static void *produce(void *a) {
+  Tier *t = a;
+  int lo = t->c->vimlo, hi = t->c->vimhi;
+  if (!lo && !hi) { lo = 1000; hi = 5000; }
+  int max = t->c->lawnsize * t->c->molesize;
+  while (__atomic_sub_fetch(&t->left, 1, __ATOMIC_RELAXED) >= 0) {
+    Packed p = {rdm(0, max - 1), rdm(0, max - 1), rdm(lo, hi), rdm(lo, hi), rdm(lo, hi)};
+    if (!mtq_shared_put(t->q, &p))
+      break; // stopped
+  }
+  return 0;
+}
+
+static void *consume(void *a) {
+  Tier *t = a;
+  Packed p;
+  // until every producer process has finished, and the queue is empty, or a stop
+  while (mtq_shared_get(t->q, &p))
+    mole_whack(mole_at(t->l, p.x, p.y, p.vim0, p.vim1, p.vim2));
+  return 0;
+}
+
+/*
+ * Stops this process, on a signal: its puts and gets end, and what is
+ * queued is left to the other processes. Moles a consumer has in flight
+ * are whacked, or, under the discard policy or when the stop runs late,
+ * hurried through their delays.
+ */
+static void stopped(void *a, int hard) {
+  Tier *t = a;
+  mtq_shared_leave(t->q);
+  if (t->l && (hard || !strcmp(t->c->stop_policy, "discard")))
+    lawn_hurry(t->l);
+}
+
+/**
+ * Runs this process's tier until the run is done, or a stop.
+ *
+ * @param c the configuration: role, shared, and the usual run parameters.
+ * @param l the consumer's lawn; 0 for a producer.
+ */
+extern void tiers(Config *c, Lawn l) {
+  Tier t = {c, mtq_open_shared(c->shared, c->mtqmax > 0 ? c->mtqmax : 64, sizeof(Packed)), l};
+  if (!strcmp(c->role, "producer")) {
+    t.left = c->moles ? c->moles : c->producers;
+    mtq_shared_register(t.q);
+    stop_on(stopped, &t, c->stop_budget);
+    wait_threads(create_threads(produce, c->producers, &t), c->producers);
+    stop_on(0, 0, 0);
+    mtq_shared_finish(t.q);
+    mtq_shared_close(t.q, 0);
+  } else if (!strcmp(c->role, "consumer")) {
+    stop_on(stopped, &t, c->stop_budget);
+    wait_threads(create_threads(consume, c->consumers, &t), c->consumers);
+    stop_on(0, 0, 0);
+    // a stopped consumer leaves the queue to the others
+    mtq_shared_close(t.q, !stop_requested());
+  } else
+    ERROR("unknown role: %s", c->role);
+}
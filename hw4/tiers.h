@@ -0,0 +1,15 @@
+#ifndef TIERS_H
+#define TIERS_H
+
+#include "config.h"
+#include "lawn.h"
+
+// Producers and consumers as separate processes, joined by a shared mtq
+// (mtqshm.h) named c->shared. A process with c->role "producer" makes
+// c->moles moles' positions and vims, packed into fixed-size records; one
+// with c->role "consumer" shows and whacks each on its lawn l. Start
+// either first; the consumers finish when the producer's run is done.
+
+extern void tiers(Config *c, Lawn l);
+
+#endif
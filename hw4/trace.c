@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "error.h"
+
+#ifdef TRACE
+
+#define SPANS (1<<15) // per thread; later spans are dropped
+
+typedef struct {
+  const char *name;
+  uint64_t t0;  // ticks
+  uint64_t dur; // ticks
+} Span;
+
+// One thread's spans. Only its thread appends; n is published with
+// release order, so a dump may read the first n spans at any time.
+typedef struct Buf {
+  struct Buf *next;
+  pid_t tid;
+  int n;
+  unsigned long dropped;
+  Span spans[SPANS];
+} *Buf;
+
+static __thread Buf mine;
+
+static struct {
+  pthread_mutex_t lock; // guards bufs and dumps
+  Buf bufs;             // every thread's, kept after it exits
+  char *path;
+  uint64_t ns, ticks;   // both clocks, read together at trace_start()
+} trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static Buf newbuf() {
+  // touch every page now, rather than fault inside later spans
+  Buf b = (Buf)malloc(sizeof(*b));
+  if (!b) ERROR("malloc() failed");
+  memset(b, 0, sizeof(*b));
+  b->tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&trace.lock);
+  b->next = trace.bufs;
+  trace.bufs = b;
+  pthread_mutex_unlock(&trace.lock);
+  return b;
+}
+
+/* Ends a span: the cleanup of a TRACE_SCOPE */
+extern void trace_end(TraceSpan *s) {
+  uint64_t t1 = trace_ticks();
+  Buf b = mine;
+  if (!b)
+    b = mine = newbuf();
+  if (b->n == SPANS) {
+    b->dropped++;
+    return;
+  }
+  Span *p = &b->spans[b->n];
+  p->name = s->name;
+  p->t0 = s->t0;
+  p->dur = t1 - s->t0;
+  __atomic_store_n(&b->n, b->n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes every thread's spans so far as Chrome trace-event JSON, with
+ * times in microseconds.
+ *
+ * @param path the file to write.
+ */
+extern void trace_dump(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    WARN("cannot write %s", path);
+    return;
+  }
+  // calibrate ticks against the monotonic clock over the whole run
+  double rate = 1;
+  uint64_t ticks = trace_ticks() - trace.ticks;
+  if (trace.ticks && ticks)
+    rate = (double)(now_ns() - trace.ns) / ticks;
+  pid_t pid = getpid();
+  unsigned long dropped = 0;
+  const char *sep = "";
+  fprintf(f, "{\"traceEvents\":[");
+  pthread_mutex_lock(&trace.lock);
+  for (Buf b = trace.bufs; b; b = b->next) {
+    int n = __atomic_load_n(&b->n, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+      Span *s = &b->spans[i];
+      fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+              sep, s->name, (trace.ns + (int64_t)(s->t0 - trace.ticks) * rate) / 1e3,
+              s->dur * rate / 1e3, pid, b->tid);
+      sep = ",";
+    }
+    dropped += b->dropped;
+  }
+  pthread_mutex_unlock(&trace.lock);
+  fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  fclose(f);
+  if (dropped)
+    WARN("trace: dropped %lu spans; buffers hold %d per thread", dropped, SPANS);
+}
+
+static void finish() {
+  trace_dump(trace.path);
+}
+
+/* Dumps the trace each time the process gets SIGUSR2 */
+static void *signals(void *a) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  for (;;) {
+    int sig;
+    if (!sigwait(&set, &sig))
+      trace_dump(trace.path);
+  }
+  return 0;
+}
+
+/**
+ * Starts tracing: the trace is written at exit and on each SIGUSR2.
+ * SIGUSR2 must be blocked in every other thread, so it reaches only the
+ * thread that waits for it: main blocks it before making any thread.
+ *
+ * @param path the file to write.
+ */
+extern void trace_start(const char *path) {
+  trace.path = strdup(path);
+  trace.ns = now_ns();
+  trace.ticks = trace_ticks();
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, 0);
+  pthread_t t;
+  if (pthread_create(&t, 0, signals, 0))
+    ERROR("pthread_create() failed");
+  pthread_detach(t);
+  atexit(finish);
+}
+
+#else
+
+extern void trace_start(const char *path) {}
+extern void trace_dump(const char *path) {}
+
+#endif
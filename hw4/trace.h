@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "linkage.h"
+#include "now.h"
+
+// Scoped timeline spans, for seeing where each thread blocks. Build with
+// -DTRACE (make TRACE=1) to record them; otherwise TRACE_SCOPE compiles
+// away. A span costs two cycle-counter reads and a store into a
+// per-thread buffer; ticks are converted to time when the trace is written. trace_start() arranges for the spans to be written as Chrome
+// trace-event JSON at exit, and each time the process gets SIGUSR2.
+
+#ifdef TRACE
+
+typedef struct {
+  const char *name;
+  uint64_t t0; // ticks
+} TraceSpan;
+
+static inline uint64_t trace_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+extern LINKAGE void trace_end(TraceSpan *s);
+
+#define TRACE_CAT2(A,B) A##B
+#define TRACE_CAT(A,B) TRACE_CAT2(A,B)
+
+#ifdef __cplusplus
+struct TraceScope {
+  TraceSpan s;
+  TraceScope(const char *name) { s.name=name; s.t0=trace_ticks(); }
+  ~TraceScope() { trace_end(&s); }
+};
+#define TRACE_SCOPE(name) TraceScope TRACE_CAT(_span,__LINE__)(name)
+#else
+#define TRACE_SCOPE(name) \
+  TraceSpan TRACE_CAT(_span,__LINE__) __attribute__((cleanup(trace_end))) = {name, trace_ticks()}
+#endif
+
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
+
+extern LINKAGE void trace_start(const char *path);
+extern LINKAGE void trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "vclock.h"
+#include "error.h"
+
+typedef enum {Ready, Running, Sleeping, Blocked, Done} State;
+
+// A simulated thread
+typedef struct VThread {
+  int id;
+  State state;
+  pthread_cond_t cv;     // it waits here for the baton
+  int go;                // it has the baton
+  uint64_t wake;         // Sleeping, or Blocked with a deadline
+  void *key;             // Blocked on this
+  int timed, timedout;   // Blocked with a deadline; and it passed
+  struct VThread *joiner;
+  struct VThread *next;  // in ready, or blocked
+  struct VThread *snext; // in sleepers
+} *VThread;
+
+static struct {
+  int on;
+  pthread_mutex_t lock;  // guards everything below, and passes the baton
+  uint64_t now;
+  int ids;
+  VThread ready, *rtail; // FIFO
+  VThread blocked;       // in the order they blocked
+  VThread sleepers;      // by wake time, then id
+} vc = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread VThread self;
+
+static VThread vnew() {
+  VThread v = (VThread)calloc(1, sizeof(*v));
+  if (!v) ERROR("calloc() failed");
+  v->id = ++vc.ids;
+  pthread_cond_init(&v->cv, 0);
+  return v;
+}
+
+static void ready(VThread v) {
+  v->state = Ready;
+  v->next = 0;
+  *vc.rtail = v;
+  vc.rtail = &v->next;
+}
+
+static void sleeper(VThread v) {
+  VThread *p = &vc.sleepers;
+  while (*p && ((*p)->wake < v->wake || ((*p)->wake == v->wake && (*p)->id < v->id)))
+    p = &(*p)->snext;
+  v->snext = *p;
+  *p = v;
+}
+
+static void unsleep(VThread v) {
+  for (VThread *p = &vc.sleepers; *p; p = &(*p)->snext)
+    if (*p == v) {
+      *p = v->snext;
+      return;
+    }
+}
+
+static void unblock(VThread v) {
+  for (VThread *p = &vc.blocked; *p; p = &(*p)->next)
+    if (*p == v) {
+      *p = v->next;
+      return;
+    }
+}
+
+/**
+ * Passes the baton from the caller, which has set its own state, to the
+ * next thread to run, advancing the clock if that thread is a sleeper.
+ * Unless the caller is Done, returns when the baton comes back to it.
+ * Called with vc.lock held.
+ */
+static void schedule() {
+  VThread me = self, next = vc.ready;
+  if (next) {
+    vc.ready = next->next;
+    if (!vc.ready)
+      vc.rtail = &vc.ready;
+  } else if ((next = vc.sleepers)) {
+    vc.sleepers = next->snext;
+    if (next->wake > vc.now)
+      vc.now = next->wake;
+    if (next->state == Blocked) {
+      unblock(next);
+      next->timedout = 1;
+    }
+  } else
+    ERROR("simulation deadlock: every thread is blocked");
+  next->state = Running;
+  if (next == me)
+    return;
+  next->go = 1;
+  pthread_cond_signal(&next->cv);
+  if (me->state == Done)
+    return;
+  while (!me->go)
+    pthread_cond_wait(&me->cv, &vc.lock);
+  me->go = 0;
+}
+
+/* Makes the caller the first simulated thread, holding the baton */
+extern void vclock_start() {
+  pthread_mutex_lock(&vc.lock);
+  vc.rtail = &vc.ready;
+  vc.now = 1000000000; // a second in, so no time is 0
+  self = vnew();
+  self->state = Running;
+  __atomic_store_n(&vc.on, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&vc.lock);
+}
+
+extern int vclock_running() {
+  return self != 0;
+}
+
+extern uint64_t vclock_now() {
+  return __atomic_load_n(&vc.now, __ATOMIC_RELAXED);
+}
+
+extern int vclock_tid() {
+  return self ? self->id : (int)syscall(SYS_gettid);
+}
+
+/* Sleeps until virtual time ns; returns 0, at once, if not simulated */
+extern int vclock_sleep_until(uint64_t ns) {
+  if (!self)
+    return 0;
+  pthread_mutex_lock(&vc.lock);
+  self->state = Sleeping;
+  self->wake = ns > vc.now ? ns : vc.now;
+  sleeper(self);
+  schedule();
+  pthread_mutex_unlock(&vc.lock);
+  return 1;
+}
+
+/**
+ * Waits, as pthread_cond_wait would, for vclock_wake(key).
+ *
+ * @param key what is waited for, such as a condition variable's address.
+ * @param m a mutex the caller holds; it is released while waiting.
+ * @param deadline virtual time to stop waiting; 0 for none.
+ * @param timedout set to 1 if the deadline passed first, else 0; may be 0.
+ *
+ * @return 0, at once, if the caller is not simulated; else 1.
+ */
+extern int vclock_wait(void *key, pthread_mutex_t *m, uint64_t deadline, int *timedout) {
+  if (!self)
+    return 0;
+  pthread_mutex_lock(&vc.lock);
+  pthread_mutex_unlock(m); // only now, so a waker under m cannot miss us
+  self->state = Blocked;
+  self->key = key;
+  self->timed = deadline != 0;
+  self->timedout = 0;
+  self->next = 0;
+  VThread *p = &vc.blocked;
+  while (*p)
+    p = &(*p)->next;
+  *p = self;
+  if (self->timed) {
+    self->wake = deadline;
+    sleeper(self);
+  }
+  schedule();
+  if (timedout)
+    *timedout = self->timedout;
+  pthread_mutex_unlock(&vc.lock);
+  pthread_mutex_lock(m);
+  return 1;
+}
+
+/* Makes one (or every) thread waiting for key ready; the caller keeps running */
+extern void vclock_wake(void *key, int all) {
+  if (!__atomic_load_n(&vc.on, __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock(&vc.lock);
+  for (VThread *p = &vc.blocked; *p;) {
+    VThread v = *p;
+    if (v->key != key) {
+      p = &v->next;
+      continue;
+    }
+    *p = v->next;
+    if (v->timed)
+      unsleep(v);
+    ready(v);
+    if (!all)
+      break;
+  }
+  pthread_mutex_unlock(&vc.lock);
+}
+
+/* Registers a thread about to be created; 0 if the caller is not simulated */
+extern void *vclock_spawn() {
+  if (!self)
+    return 0;
+  pthread_mutex_lock(&vc.lock);
+  VThread v = vnew();
+  ready(v);
+  pthread_mutex_unlock(&vc.lock);
+  return v;
+}
+
+/* Waits, in the new thread, for its first turn */
+extern void vclock_enter(void *v) {
+  pthread_mutex_lock(&vc.lock);
+  self = (VThread)v;
+  while (!self->go)
+    pthread_cond_wait(&self->cv, &vc.lock);
+  self->go = 0;
+  pthread_mutex_unlock(&vc.lock);
+}
+
+/* Ends the caller's simulation, passing the baton on for good */
+extern void vclock_exit() {
+  pthread_mutex_lock(&vc.lock);
+  self->state = Done;
+  if (self->joiner)
+    ready(self->joiner);
+  schedule();
+  pthread_mutex_unlock(&vc.lock);
+  self = 0;
+}
+
+/* Waits for a simulated thread to exit, and frees its record */
+extern void vclock_join(void *t) {
+  VThread v = (VThread)t;
+  pthread_mutex_lock(&vc.lock);
+  if (v->state != Done) {
+    v->joiner = self;
+    self->state = Blocked;
+    schedule();
+  }
+  pthread_mutex_unlock(&vc.lock);
+  pthread_cond_destroy(&v->cv);
+  free(v);
+}
@@ -0,0 +1,33 @@
+#ifndef VCLOCK_H
+#define VCLOCK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "linkage.h"
+
+// Virtual time, for deterministic simulation. Once vclock_start() is
+// called, the threads made by threads.c run one at a time, passing a
+// baton at each point where they would block: a sleep, an mtq wait, a
+// join, or exit. The next to run is the longest-ready thread or, if none
+// is ready, the earliest sleeper, and the clock jumps to its wake time.
+// So a run takes as long as its computation, not its sleeps, and, with a
+// fixed seed, makes the same choices every time.
+//
+// Threads not made by threads.c (the logger, a display) are not
+// simulated, and see real time. The hooks below fall through, returning
+// 0, when the caller is not a simulated thread.
+
+extern LINKAGE void     vclock_start();
+extern LINKAGE int      vclock_running();              // the caller is simulated
+extern LINKAGE uint64_t vclock_now();                  // ns
+extern LINKAGE int      vclock_tid();                  // 1, 2, ... in creation order; else the kernel's
+extern LINKAGE int      vclock_sleep_until(uint64_t ns);
+extern LINKAGE int      vclock_wait(void *key, pthread_mutex_t *m, uint64_t deadline, int *timedout);
+extern LINKAGE void     vclock_wake(void *key, int all);
+extern LINKAGE void    *vclock_spawn();                // by the creator, before pthread_create
+extern LINKAGE void     vclock_enter(void *v);         // first, in the new thread
+extern LINKAGE void     vclock_exit();                 // last, in the new thread
+extern LINKAGE void     vclock_join(void *v);
+
+#endif
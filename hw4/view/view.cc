@@ -0,0 +1,86 @@
+// A viewer for a wam run with --backend=shm: it attaches to the run's
+// shared-memory ring and owns the window, so the run needs no display,
+// and its workers never wait for drawing. Without DISPLAY, it prints
+// each event instead. It exits when the run has finished and the ring
+// is drained.
+//
+// usage: view [ring]   (default /wam-lawn, as for wam --shm)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <FL/Fl.H>
+#include <FL/Fl_Window.H>
+#include <FL/Fl_Box.H>
+
+#include "shmring.h"
+#include "raster.h"
+
+#define PERIOD 0.016 // seconds between polls of the ring
+#define BATCH  4096  // events applied per poll, at most
+
+static ShmRing ring;
+static int lawnsize, molesize;
+static Fl_Window* window;
+static Fl_Box** boxes; // one per cell, made when first needed
+
+static void show(uint32_t e) {
+  int c=SHMRING_CELL(e), s=SHMRING_STATE(e);
+  if (c>=lawnsize*lawnsize) return;
+  int x=c%lawnsize*molesize, y=c/lawnsize*molesize;
+  if (!window) {
+    static const char* names[]={"expired","created","whacked"};
+    printf("(%d,%d) %s\n",x,y,names[s]);
+    return;
+  }
+  Fl_Box* b=boxes[c];
+  if (!b) {
+    if (s==RasterNone) return;
+    window->begin();
+    b=boxes[c]=new Fl_Box(x,y,molesize,molesize);
+    b->box(FL_OVAL_BOX);
+    window->end();
+  }
+  if (s==RasterNone) b->hide();
+  else { b->color(s==RasterGreen ? FL_GREEN : FL_RED); b->show(); }
+}
+
+// Applies a batch of events; returns 0 once the run is over and drained
+static int poll() {
+  int closed=shmring_closed(ring); // read first, so no event is missed
+  uint32_t e;
+  int n=0;
+  while (n<BATCH && shmring_pop(ring,&e)) { show(e); n++; }
+  if (window && n) window->redraw();
+  return !(closed && n<BATCH);
+}
+
+static void tick(void*) {
+  if (poll()) Fl::repeat_timeout(PERIOD,tick);
+  else window->hide();
+}
+
+int main(int argc, char** argv) {
+  const char* name=argc>1 ? argv[1] : "/wam-lawn";
+  while (!(ring=shmring_attach(name))) usleep(100000);
+  shmring_lawn(ring,&lawnsize,&molesize);
+
+  char* d=getenv("DISPLAY");
+  if (!(d && *d)) {
+    while (poll()) usleep(PERIOD*1e6);
+    fflush(stdout);
+  } else {
+    boxes=(Fl_Box**)calloc(lawnsize*lawnsize,sizeof(*boxes));
+    if (!boxes) { perror("calloc"); return 1; }
+    window=new Fl_Window(lawnsize*molesize,lawnsize*molesize,name);
+    window->end();
+    window->show();
+    Fl::add_timeout(PERIOD,tick);
+    Fl::run();
+    delete window;
+    free(boxes);
+  }
+  shmring_free(ring);
+  return 0;
+}